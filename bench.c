@@ -0,0 +1,82 @@
+/*
+ * @Description: throughput, latency and upload time of SM2_Sign for each submission backend
+ * @FilePath: /HSM2_PCIE/bench.c
+ *
+ * usage: bench [iterations] [engine 0|1]
+ */
+#include "libHSM2.h"
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench_backend(device_t *dev, U32 base_addr, int backend, const char *name, int iterations)
+{
+    U32 rand[8] = {
+        0x12345678, 0x12345678, 0x12345678, 0x12345678,
+        0x12345678, 0x12345678, 0x12345678, 0x12345678};
+    U32 pri_key[8] = {
+        0x3ea27606, 0xca83bffa, 0x3b946b0c, 0xdb8ff076,
+        0xe4dd3d1a, 0xaf2bd6e2, 0x7290cefd, 0xc4365cf6};
+    U32 hash[8] = {
+        0xfd93ea51, 0x6080a881, 0x1b3a16ff, 0x5f465ff7,
+        0x2a1c94b6, 0xa55f6fa5, 0xcb7bd2b2, 0x501023c6};
+    U32 sign[16];
+    SM2_job_t job;
+
+    if (device_set_backend(dev, backend) < 0)
+    {
+        printf("%-6s unavailable\n", name);
+        return;
+    }
+
+    // warm up
+    for (int i = 0; i < 16; i++)
+    {
+        SM2_Sign(dev, base_addr, rand, pri_key, hash, sign);
+    }
+
+    double min_lat = 1e9, max_lat = 0, upload = 0;
+    double start = now_sec();
+    for (int i = 0; i < iterations; i++)
+    {
+        double t0 = now_sec();
+        SM2_SignSubmit(dev, base_addr, &job, rand, pri_key, hash, sign);
+        double t1 = now_sec();
+        SM2_Wait(&job);
+        double lat = now_sec() - t0;
+        upload += t1 - t0;
+        if (lat < min_lat)
+            min_lat = lat;
+        if (lat > max_lat)
+            max_lat = lat;
+    }
+    double elapsed = now_sec() - start;
+
+    printf("%-6s %8d ops  %10.1f ops/sec  avg %8.2f us  min %8.2f us  max %8.2f us  upload %8.2f us\n",
+           name, iterations, iterations / elapsed, elapsed / iterations * 1e6,
+           min_lat * 1e6, max_lat * 1e6, upload / iterations * 1e6);
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 10000;
+    U32 base_addr = (argc > 2 && atoi(argv[2]) == 0) ? BASE_ADDR0 : BASE_ADDR1;
+
+    device_t *dev;
+    if (open_device(&dev) < 0)
+    {
+        return 1;
+    }
+    SM2_Init(dev, base_addr);
+
+    bench_backend(dev, base_addr, SM2_BACKEND_MSYNC, "msync", iterations);
+    bench_backend(dev, base_addr, SM2_BACKEND_FENCE, "fence", iterations);
+    bench_backend(dev, base_addr, SM2_BACKEND_WC, "wc", iterations);
+
+    close_device(dev);
+    return 0;
+}
@@ -0,0 +1,221 @@
+/*
+ * @Description: serve the shared statistics of every HSM2 card as OpenMetrics text on a Unix socket
+ * @FilePath: /HSM2_PCIE/hsm2_exporter.c
+ *
+ * usage: hsm2_exporter [socket path]    (default /tmp/hsm2-metrics.sock)
+ *
+ * Each connection gets one scrape. A client that starts with an HTTP
+ * request line (Prometheus through a socket proxy, curl --unix-socket)
+ * gets an HTTP/1.0 response, anything else the bare text. Engine
+ * utilisation is rate(hsm2_engine_busy_seconds_total[1m]), an upper
+ * bound since busy time ends when a caller sees the engine idle. The
+ * exporter must be able to read the segments, see HSM2_SHM_MODE.
+ */
+#include "libHSM2.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define STATS_PREFIX "hsm2-stats-"
+
+/* Latency histogram bounds exported, 2^10 ns (~1 us) to 2^33 ns (~8.6 s) */
+#define LE_FIRST 10
+#define LE_LAST 33
+
+static const char *op_names[SM2_NUM_OPS] = {"genkey", "sign", "verify", "encrypt", "decrypt", "keyx", "init"};
+
+static void counter(FILE *fp, const char *name, const char *help, SM2_stats_t **cards, int ncards, int field)
+{
+    fprintf(fp, "# TYPE hsm2_%s counter\n# HELP hsm2_%s %s\n", name, name, help);
+    for (int c = 0; c < ncards; c++)
+    {
+        for (int e = 0; e < 2; e++)
+        {
+            for (int op = 0; op < SM2_NUM_OPS; op++)
+            {
+                const SM2_op_stats_t *s = &cards[c]->op[e][op];
+                const U64 *fields[] = {&s->ops, &s->errors, &s->timeouts, &s->polls};
+                fprintf(fp, "hsm2_%s_total{card=\"%s\",engine=\"%d\",op=\"%s\"} %llu\n",
+                        name, cards[c]->bdf, e, op_names[op], __atomic_load_n(fields[field], __ATOMIC_RELAXED));
+            }
+        }
+    }
+}
+
+static void render(FILE *fp, SM2_stats_t **cards, int ncards)
+{
+    counter(fp, "ops", "Commands completed.", cards, ncards, 0);
+    counter(fp, "errors", "Commands completed with the STATE check bit set.", cards, ncards, 1);
+    counter(fp, "timeouts", "Waits that gave up on a busy engine.", cards, ncards, 2);
+    counter(fp, "polls", "STATE reads that found the engine busy.", cards, ncards, 3);
+
+    fprintf(fp, "# TYPE hsm2_engine_busy_seconds counter\n"
+                "# HELP hsm2_engine_busy_seconds Command write to the first STATE read that found the engine idle.\n");
+    for (int c = 0; c < ncards; c++)
+    {
+        for (int e = 0; e < 2; e++)
+        {
+            U64 busy = 0;
+            for (int op = 0; op < SM2_NUM_OPS; op++)
+            {
+                busy += __atomic_load_n(&cards[c]->op[e][op].busy_ns, __ATOMIC_RELAXED);
+            }
+            fprintf(fp, "hsm2_engine_busy_seconds_total{card=\"%s\",engine=\"%d\"} %.9f\n",
+                    cards[c]->bdf, e, busy * 1e-9);
+        }
+    }
+
+    fprintf(fp, "# TYPE hsm2_latency_seconds histogram\n"
+                "# HELP hsm2_latency_seconds Command write to the first STATE read that found the engine idle.\n");
+    for (int c = 0; c < ncards; c++)
+    {
+        for (int e = 0; e < 2; e++)
+        {
+            for (int op = 0; op < SM2_NUM_OPS; op++)
+            {
+                const SM2_op_stats_t *s = &cards[c]->op[e][op];
+                U64 hist[SM2_HIST_BUCKETS], count = 0;
+                int b = 0;
+
+                // one pass so the cumulative buckets, +Inf and count agree
+                for (int i = 0; i < SM2_HIST_BUCKETS; i++)
+                {
+                    hist[i] = __atomic_load_n(&s->hist[i], __ATOMIC_RELAXED);
+                }
+                for (int k = LE_FIRST; k <= LE_LAST; k++)
+                {
+                    // every bucket below 2^k ns lies wholly under the bound
+                    for (; b < SM2_HIST_BUCKETS && SM2_HistLower(b) < (1ULL << k); b++)
+                    {
+                        count += hist[b];
+                    }
+                    fprintf(fp, "hsm2_latency_seconds_bucket{card=\"%s\",engine=\"%d\",op=\"%s\",le=\"%g\"} %llu\n",
+                            cards[c]->bdf, e, op_names[op], (1ULL << k) * 1e-9, count);
+                }
+                for (; b < SM2_HIST_BUCKETS; b++)
+                {
+                    count += hist[b];
+                }
+                fprintf(fp, "hsm2_latency_seconds_bucket{card=\"%s\",engine=\"%d\",op=\"%s\",le=\"+Inf\"} %llu\n",
+                        cards[c]->bdf, e, op_names[op], count);
+                fprintf(fp, "hsm2_latency_seconds_count{card=\"%s\",engine=\"%d\",op=\"%s\"} %llu\n",
+                        cards[c]->bdf, e, op_names[op], count);
+                fprintf(fp, "hsm2_latency_seconds_sum{card=\"%s\",engine=\"%d\",op=\"%s\"} %.9f\n",
+                        cards[c]->bdf, e, op_names[op], __atomic_load_n(&s->busy_ns, __ATOMIC_RELAXED) * 1e-9);
+            }
+        }
+    }
+    fprintf(fp, "# EOF\n");
+}
+
+static int map_cards(SM2_stats_t **cards, int max)
+{
+    char name[300];
+    struct dirent *entry;
+    int n = 0;
+    DIR *dir = opendir("/dev/shm");
+
+    if (dir == NULL)
+    {
+        return 0;
+    }
+    while (n < max && (entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, STATS_PREFIX, strlen(STATS_PREFIX)) != 0)
+        {
+            continue;
+        }
+        snprintf(name, sizeof(name), "/%s", entry->d_name);
+        cards[n] = SM2_StatsMap(name);
+        if (cards[n] != NULL)
+        {
+            n++;
+        }
+    }
+    closedir(dir);
+    return n;
+}
+
+static void serve(int conn)
+{
+    SM2_stats_t *cards[HSM2_MAX_DEVICES];
+    struct pollfd pfd = {conn, POLLIN, 0};
+    char request[512];
+    int http = 0;
+
+    // a scraper speaking HTTP sends its request straight away
+    if (poll(&pfd, 1, 100) > 0)
+    {
+        ssize_t len = read(conn, request, sizeof(request) - 1);
+        http = len >= 4 && strncmp(request, "GET ", 4) == 0;
+    }
+
+    FILE *fp = fdopen(conn, "w");
+    if (fp == NULL)
+    {
+        close(conn);
+        return;
+    }
+    if (http)
+    {
+        fprintf(fp, "HTTP/1.0 200 OK\r\n"
+                    "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                    "Connection: close\r\n\r\n");
+    }
+
+    int ncards = map_cards(cards, HSM2_MAX_DEVICES);
+    render(fp, cards, ncards);
+    for (int i = 0; i < ncards; i++)
+    {
+        SM2_StatsUnmap(cards[i]);
+    }
+    fclose(fp);
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = argc > 1 ? argv[1] : "/tmp/hsm2-metrics.sock";
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        printf("Socket path too long: %s\n", path);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        printf("socket() failed: errno %d, %s\n", errno, strerror(errno));
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0)
+    {
+        printf("Listen on '%s' failed: errno %d, %s\n", path, errno, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    printf("serving HSM2 metrics on %s\n", path);
+
+    for (;;)
+    {
+        int conn = accept(fd, NULL, NULL);
+        if (conn < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printf("accept() failed: errno %d, %s\n", errno, strerror(errno));
+            break;
+        }
+        serve(conn);
+    }
+    close(fd);
+    return 1;
+}
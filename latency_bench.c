@@ -0,0 +1,443 @@
+/*
+ * @Description: p50/p99/p99.9 latency and sustained ops/sec of every opcode through the engine pool,
+ *               swept over threads, engines per card and cards, with JSON output and a regression check
+ * @FilePath: /HSM2_PCIE/latency_bench.c
+ *
+ * usage: latency_bench [-n ops] [-t threads,...] [-e engines,...] [-c cards,...]
+ *                      [-o results.json] [-b baseline.json] [-r tolerance%] [-s]
+ *
+ *   -n  ops per opcode and configuration (default 10000)
+ *   -t  thread counts to sweep (default 1,2,4,8)
+ *   -e  engines per card to sweep, 1 or 2 (default 1,2)
+ *   -c  card counts to sweep (default every card found)
+ *   -o  write the results as JSON
+ *   -b  compare against a JSON file written by -o; exit 1 if any
+ *       configuration lost more than -r percent (default 10) of its
+ *       ops/sec, grew its p99 by more than that or had more errors,
+ *       and also when the baseline has no results or none of them
+ *       matches a configuration that was run
+ *   -s  timing only on simulated cards ($HSM2_SIM), skip the curve math
+ */
+#include "libHSM2.h"
+
+#define MAX_SWEEP 16
+#define MAX_RESULTS 1024
+
+typedef struct
+{
+    char op[16];
+    int cards, engines, threads;
+    int ops, errors;
+    double ops_per_sec, p50_us, p99_us, p999_us;
+} result_t;
+
+typedef struct
+{
+    U32 rand[8], pri_key[8], pub_key[16], hash[8], sign[16];
+    U32 C1[16], S[16], Rx[8], UV[16];
+} vectors_t;
+
+typedef struct
+{
+    SM2_pool_t *pool;
+    int op;
+    int count;
+    vectors_t v;
+
+    /* Latency of each op in ns, and failed ops */
+    U64 *lat;
+    int errors;
+} worker_t;
+
+static const char *names[] = {"genkey", "sign", "verify", "encrypt", "decrypt", "keyx"};
+
+static U64 now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (U64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int run_op(SM2_pool_t *pool, int op, vectors_t *v)
+{
+    switch (op)
+    {
+    case SM2_OP_GENKEY:
+        return SM2_PoolGenKey(pool, v->rand, v->pri_key, v->pub_key);
+    case SM2_OP_SIGN:
+        return SM2_PoolSign(pool, v->rand, v->pri_key, v->hash, v->sign);
+    case SM2_OP_VERIFY:
+        return SM2_PoolVerify(pool, v->pub_key, v->hash, v->sign);
+    case SM2_OP_ENCRYPT:
+        return SM2_PoolEncrypt(pool, v->rand, v->pub_key, v->C1, v->S);
+    case SM2_OP_DECRYPT:
+        return SM2_PoolDecrypt(pool, v->pri_key, v->C1, v->S);
+    default:
+        return SM2_PoolKeyExchange(pool, v->rand, v->Rx, v->pri_key, v->pub_key, v->pub_key, v->UV);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+
+    for (int i = 0; i < w->count; i++)
+    {
+        U64 t0 = now_ns();
+        int ret = run_op(w->pool, w->op, &w->v);
+        w->lat[i] = now_ns() - t0;
+        if (ret != 0)
+        {
+            w->errors++;
+        }
+    }
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    U64 x = *(const U64 *)a, y = *(const U64 *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const U64 *sorted, int n, double p)
+{
+    // nearest rank
+    int rank = (int)(p * n + 0.999999);
+    if (rank < 1)
+    {
+        rank = 1;
+    }
+    return sorted[rank - 1] / 1000.0;
+}
+
+static int parse_list(const char *s, int *list)
+{
+    int n = 0;
+    while (*s && n < MAX_SWEEP)
+    {
+        list[n++] = atoi(s);
+        s = strchr(s, ',');
+        if (s == NULL)
+        {
+            break;
+        }
+        s++;
+    }
+    return n;
+}
+
+static int bench_config(SM2_pool_t *pool, int op, int threads, int ops, const vectors_t *v, result_t *r)
+{
+    worker_t *workers = (worker_t *)calloc(threads, sizeof(worker_t));
+    pthread_t *tids = (pthread_t *)calloc(threads, sizeof(pthread_t));
+    U64 *lat = (U64 *)calloc(ops, sizeof(U64));
+    int done = 0;
+
+    if (workers == NULL || tids == NULL || lat == NULL)
+    {
+        free(workers);
+        free(tids);
+        free(lat);
+        return -1;
+    }
+
+    // warm up: one op per thread, also brings every engine's wait policy in
+    for (int i = 0; i < threads; i++)
+    {
+        vectors_t scratch = *v;
+        run_op(pool, op, &scratch);
+    }
+
+    U64 start = now_ns();
+    for (int i = 0; i < threads; i++)
+    {
+        workers[i].pool = pool;
+        workers[i].op = op;
+        workers[i].count = ops / threads + (i < ops % threads);
+        workers[i].v = *v;
+        workers[i].lat = lat + done;
+        done += workers[i].count;
+        pthread_create(&tids[i], NULL, worker_main, &workers[i]);
+    }
+    r->errors = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(tids[i], NULL);
+        r->errors += workers[i].errors;
+    }
+    U64 elapsed = now_ns() - start;
+
+    qsort(lat, ops, sizeof(U64), cmp_u64);
+    snprintf(r->op, sizeof(r->op), "%s", names[op]);
+    r->threads = threads;
+    r->ops = ops;
+    r->ops_per_sec = ops / (elapsed * 1e-9);
+    r->p50_us = percentile_us(lat, ops, 0.50);
+    r->p99_us = percentile_us(lat, ops, 0.99);
+    r->p999_us = percentile_us(lat, ops, 0.999);
+
+    free(workers);
+    free(tids);
+    free(lat);
+    return 0;
+}
+
+static void write_json(const char *path, const result_t *results, int n)
+{
+    char host[64] = "unknown";
+    FILE *fp = fopen(path, "w");
+
+    if (fp == NULL)
+    {
+        printf("Cannot write %s: %s\n", path, strerror(errno));
+        return;
+    }
+    gethostname(host, sizeof(host) - 1);
+
+    // one result per line, read back by read_json()
+    fprintf(fp, "{\n  \"host\": \"%s\",\n  \"time\": %ld,\n  \"results\": [\n", host, (long)time(NULL));
+    for (int i = 0; i < n; i++)
+    {
+        const result_t *r = &results[i];
+        fprintf(fp, "    {\"op\": \"%s\", \"cards\": %d, \"engines\": %d, \"threads\": %d, \"ops\": %d, \"errors\": %d, "
+                    "\"ops_per_sec\": %.1f, \"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f}%s\n",
+                r->op, r->cards, r->engines, r->threads, r->ops, r->errors,
+                r->ops_per_sec, r->p50_us, r->p99_us, r->p999_us, i + 1 < n ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+}
+
+static int read_json(const char *path, result_t *results, int max)
+{
+    char line[512];
+    int n = 0;
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL)
+    {
+        printf("Cannot read %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (n < max && fgets(line, sizeof(line), fp) != NULL)
+    {
+        result_t *r = &results[n];
+        if (sscanf(line, " {\"op\": \"%15[^\"]\", \"cards\": %d, \"engines\": %d, \"threads\": %d, \"ops\": %d, \"errors\": %d, "
+                         "\"ops_per_sec\": %lf, \"p50_us\": %lf, \"p99_us\": %lf, \"p999_us\": %lf",
+                   r->op, &r->cards, &r->engines, &r->threads, &r->ops, &r->errors,
+                   &r->ops_per_sec, &r->p50_us, &r->p99_us, &r->p999_us) == 10)
+        {
+            n++;
+        }
+    }
+    fclose(fp);
+    if (n == 0)
+    {
+        printf("No results in %s\n", path);
+        return -1;
+    }
+    return n;
+}
+
+static int compare(const result_t *base, int nbase, const result_t *results, int n, double tolerance)
+{
+    /**
+     * @return: int
+     *          number of configurations that regressed
+     *          -1 - no configuration of this run is in the baseline
+     */
+    int regressions = 0, matched = 0;
+
+    printf("\n%-8s %5s %7s %7s %12s %12s %10s %10s %7s %7s\n",
+           "op", "cards", "engines", "threads", "ops/sec", "base", "p99 us", "base", "errors", "base");
+    for (int i = 0; i < n; i++)
+    {
+        const result_t *r = &results[i], *b = NULL;
+        for (int j = 0; j < nbase; j++)
+        {
+            if (strcmp(base[j].op, r->op) == 0 && base[j].cards == r->cards &&
+                base[j].engines == r->engines && base[j].threads == r->threads)
+            {
+                b = &base[j];
+                break;
+            }
+        }
+        if (b == NULL)
+        {
+            continue;
+        }
+
+        // any new error is a regression, whatever the tolerance
+        int worse = r->ops_per_sec < b->ops_per_sec * (1 - tolerance) ||
+                    r->p99_us > b->p99_us * (1 + tolerance) || r->errors > b->errors;
+        matched++;
+        regressions += worse;
+        printf("%-8s %5d %7d %7d %12.1f %12.1f %10.2f %10.2f %7d %7d%s\n",
+               r->op, r->cards, r->engines, r->threads, r->ops_per_sec, b->ops_per_sec,
+               r->p99_us, b->p99_us, r->errors, b->errors, worse ? "  REGRESSION" : "");
+    }
+    if (matched == 0)
+    {
+        printf("No configuration of this run is in the baseline\n");
+        return -1;
+    }
+    printf("%d regression(s) beyond %.0f%%\n", regressions, tolerance * 100);
+    return regressions;
+}
+
+int main(int argc, char **argv)
+{
+    int thread_list[MAX_SWEEP] = {1, 2, 4, 8}, nthreads = 4;
+    int engine_list[MAX_SWEEP] = {1, 2}, nengines = 2;
+    int card_list[MAX_SWEEP], ncards = 0;
+    int ops = 10000, timing_only = 0, opt;
+    const char *out = NULL, *baseline = NULL;
+    double tolerance = 0.10;
+
+    while ((opt = getopt(argc, argv, "n:t:e:c:o:b:r:s")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            ops = atoi(optarg);
+            break;
+        case 't':
+            nthreads = parse_list(optarg, thread_list);
+            break;
+        case 'e':
+            nengines = parse_list(optarg, engine_list);
+            break;
+        case 'c':
+            ncards = parse_list(optarg, card_list);
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        case 'b':
+            baseline = optarg;
+            break;
+        case 'r':
+            tolerance = atof(optarg) / 100;
+            break;
+        case 's':
+            timing_only = 1;
+            break;
+        default:
+            printf("usage: %s [-n ops] [-t threads,...] [-e engines,...] [-c cards,...] "
+                   "[-o results.json] [-b baseline.json] [-r tolerance%%] [-s]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (ops <= 0)
+    {
+        return 2;
+    }
+
+    device_t *devs[HSM2_MAX_DEVICES];
+    int ndev = open_all_devices(devs, HSM2_MAX_DEVICES);
+    if (ndev <= 0)
+    {
+        printf("No HSM2 card found\n");
+        return 1;
+    }
+    if (ncards == 0)
+    {
+        card_list[ncards++] = ndev;
+    }
+    for (int i = 0; timing_only && i < ndev; i++)
+    {
+        device_sim_set_compute(devs[i], 0);
+    }
+
+    result_t *results = (result_t *)calloc(MAX_RESULTS, sizeof(result_t));
+    int nresults = 0;
+
+    printf("%-8s %5s %7s %7s %8s %6s %12s %10s %10s %10s\n",
+           "op", "cards", "engines", "threads", "ops", "errors", "ops/sec", "p50 us", "p99 us", "p99.9 us");
+    for (int c = 0; c < ncards; c++)
+    {
+        int cards = card_list[c];
+        if (cards <= 0 || cards > ndev)
+        {
+            printf("Skipping %d cards, %d found\n", cards, ndev);
+            continue;
+        }
+        for (int e = 0; e < nengines; e++)
+        {
+            int engines = engine_list[e];
+            SM2_pool_t *pool;
+
+            if ((engines != 1 && engines != 2) || pool_create(&pool, devs, cards, SM2_POOL_LAZY_INIT) < 0)
+            {
+                continue;
+            }
+            if (engines == 1)
+            {
+                // keep the BASE_ADDR0 engine of each card
+                for (int i = 0; i < cards; i++)
+                {
+                    pool->engines[i] = pool->engines[2 * i];
+                }
+                pool->nengines = cards;
+            }
+            SM2_InitEngines(pool->engines, pool->nengines);
+
+            // one key pair, signature and ciphertext that the later ops consume
+            vectors_t v;
+            memset(&v, 0, sizeof(v));
+            for (int i = 0; i < 8; i++)
+            {
+                v.rand[i] = 0x12345678;
+                v.hash[i] = 0x9abcdef0 + i;
+                v.Rx[i] = 0x0f0f0f0f;
+            }
+            run_op(pool, SM2_OP_GENKEY, &v);
+            run_op(pool, SM2_OP_SIGN, &v);
+            run_op(pool, SM2_OP_ENCRYPT, &v);
+
+            for (int t = 0; t < nthreads; t++)
+            {
+                for (int op = SM2_OP_GENKEY; op <= SM2_OP_KEYX && nresults < MAX_RESULTS; op++)
+                {
+                    result_t *r = &results[nresults];
+                    if (thread_list[t] <= 0 || bench_config(pool, op, thread_list[t], ops, &v, r) < 0)
+                    {
+                        continue;
+                    }
+                    r->cards = cards;
+                    r->engines = engines;
+                    nresults++;
+                    printf("%-8s %5d %7d %7d %8d %6d %12.1f %10.2f %10.2f %10.2f\n",
+                           r->op, r->cards, r->engines, r->threads, r->ops, r->errors,
+                           r->ops_per_sec, r->p50_us, r->p99_us, r->p999_us);
+                }
+            }
+            pool_destroy(pool);
+        }
+    }
+
+    if (out != NULL)
+    {
+        write_json(out, results, nresults);
+    }
+
+    int ret = 0;
+    if (baseline != NULL)
+    {
+        result_t *base = (result_t *)calloc(MAX_RESULTS, sizeof(result_t));
+        int nbase = read_json(baseline, base, MAX_RESULTS);
+        if (nbase < 0 || compare(base, nbase, results, nresults, tolerance) != 0)
+        {
+            ret = 1;
+        }
+        free(base);
+    }
+
+    free(results);
+    for (int i = 0; i < ndev; i++)
+    {
+        close_device(devs[i]);
+    }
+    return ret;
+}
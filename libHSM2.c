@@ -1,40 +1,367 @@
 #include "libHSM2.h"
 
+// phase tracing, private to the library, see SM2_TraceDump()
+#ifdef HSM2_TRACE
+static U64 trace_tsc(void);
+static void trace_record(U32 phase, U64 start, U32 arg);
+#define TRACE_BEGIN(t) U64 t = trace_tsc()
+#define TRACE_END(t, phase, arg) trace_record(phase, t, arg)
+#else
+#define TRACE_BEGIN(t)
+#define TRACE_END(t, phase, arg)
+#endif
 
+// internal helpers, defined below
+static void write_block(device_t *dev, U32 addr, const U32 *src, U32 nwords);
+static void flush_block(device_t *dev, U32 addr, U32 len);
+static void sync_range(device_t *dev, U32 addr, U32 len);
+static void stream_out(U8 *dst, const U8 *src, U32 len);
+static void write_cmd(device_t *dev, U32 base_addr, U32 cmd);
+static U32 read_block(device_t *dev, U32 addr, U32 *dst, U32 nwords);
+static void upload(device_t *dev, U32 base_addr, U32 offset, const U32 *src, U32 nwords);
+static void upload_flush(device_t *dev, U32 base_addr);
+static void shadow_invalidate(device_t *dev, U32 base_addr);
+static U32 wait_idle(device_t *dev, U32 base_addr, U32 cmd, U64 issued_ns, U64 deadline_ns);
+static U64 now_ns(void);
+static void cpu_relax(void);
+static void map_control_block(device_t *dev);
+static void irq_wake_open(device_t *dev);
+static void irq_probe(device_t *dev, U32 base_addr);
+static int init_owned(device_t *dev, U32 base_addr);
+static void map_stats_block(device_t *dev);
+static void stats_complete(device_t *dev, U32 base_addr, U32 cmd, U64 issued_ns, U32 d32);
+static void stats_polls(device_t *dev, U32 base_addr, U32 cmd, U32 polls);
+static void stats_timeout(device_t *dev, U32 base_addr, U32 cmd);
+static U32 init_wait(device_t *dev, U32 base_addr, U32 cmd);
+static int op_index(U32 cmd);
+static U32 crc32_update(U32 crc, const void *buf, size_t len);
+static void sim_doorbell(device_t *dev, U32 base_addr, U32 cmd);
+static void sim_stop(device_t *dev);
+static int sim_cards(void);
 
-int open_device(device_t **dev)
-{
-    *dev = (device_t *)malloc(sizeof(device_t));
-    memset(*dev, 0, sizeof(device_t));
 
+
+int enum_devices(device_info_t *infos, int max)
+{
+    /**
+     * @description: list every HSM2 function on the bus
+     * @param: 
+     *          infos - filled with up to max entries
+     *          max - capacity of infos
+     * @return: int
+     *          number of cards found, at most max
+     */
     struct pci_access *pacc;
     struct pci_dev *dev_t;
+    int n = 0;
 
     pacc = pci_alloc(); // get the pci_access structure
     pci_init(pacc);     // initialize the pci library
     pci_scan_bus(pacc); // get the list of devices
 
-    for (dev_t = pacc->devices;; dev_t = dev_t->next)
+    for (dev_t = pacc->devices; dev_t != NULL && n < max; dev_t = dev_t->next)
     {
-        pci_fill_info(dev_t, PCI_FILL_IDENT | PCI_FILL_BASES | PCI_FILL_CLASS); // fill in header info we need
-        if (dev_t->vendor_id == 0x10ee && dev_t->device_id == 0x7024)
+        // fill in header info we need
+        pci_fill_info(dev_t, PCI_FILL_IDENT | PCI_FILL_IRQ | PCI_FILL_BASES | PCI_FILL_SIZES |
+                                 PCI_FILL_CLASS | PCI_FILL_NUMA_NODE);
+        if (dev_t->vendor_id == HSM2_VENDOR_ID && dev_t->device_id == HSM2_DEVICE_ID)
         {
-            (*dev)->bus = dev_t->bus;
-            (*dev)->slot = dev_t->dev;
-            (*dev)->function = dev_t->func;
-            printf("%04x:%02x:%02x.%d vendor=%04x device=%04x class=%04x irq=%d base0=%lx\n",
+            memset(&infos[n], 0, sizeof(device_info_t));
+            infos[n].domain = dev_t->domain;
+            infos[n].bus = dev_t->bus;
+            infos[n].slot = dev_t->dev;
+            infos[n].function = dev_t->func;
+            infos[n].irq = dev_t->irq;
+            infos[n].numa_node = dev_t->numa_node;
+            infos[n].bar_size = (U32)dev_t->size[0];
+            printf("%04x:%02x:%02x.%d vendor=%04x device=%04x class=%04x irq=%d numa=%d base0=%lx size0=%x\n",
                    dev_t->domain, dev_t->bus, dev_t->dev, dev_t->func, dev_t->vendor_id, dev_t->device_id,
-                   dev_t->device_class, dev_t->irq, (long)dev_t->base_addr[0]);
-            break;
+                   dev_t->device_class, dev_t->irq, dev_t->numa_node, (long)dev_t->base_addr[0],
+                   infos[n].bar_size);
+            n++;
         }
     }
     pci_cleanup(pacc); // close
+    return n;
+}
+
+/* ----------------------------------------------------------------
+ * libpci-free discovery
+ *
+ * Reads vendor/device straight from /sys/bus/pci/devices. A BDF
+ * given in $HSM2_BDF, or the one cached by the previous open, is
+ * checked first so a restart normally skips the directory scan.
+ * ----------------------------------------------------------------
+ */
+static int read_sysfs_value(const char *devdir, const char *name, long *val)
+{
+    char path[256];
+    FILE *fp;
+    int n;
+
+    snprintf(path, sizeof(path), "%s/%s", devdir, name);
+    fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+    n = fscanf(fp, "%li", val);
+    fclose(fp);
+    return n == 1 ? 0 : -1;
+}
+
+static int probe_sysfs_device(const char *bdf, device_info_t *info)
+{
+    char devdir[128];
+    long vendor, device, val;
+    FILE *fp;
+
+    memset(info, 0, sizeof(device_info_t));
+    if (sscanf(bdf, "%x:%x:%x.%x", &info->domain, &info->bus, &info->slot, &info->function) != 4)
+    {
+        return -1;
+    }
+
+    snprintf(devdir, sizeof(devdir), "/sys/bus/pci/devices/%04x:%02x:%02x.%1x",
+             info->domain, info->bus, info->slot, info->function);
+    if (read_sysfs_value(devdir, "vendor", &vendor) < 0 || read_sysfs_value(devdir, "device", &device) < 0)
+    {
+        return -1;
+    }
+    if (vendor != HSM2_VENDOR_ID || device != HSM2_DEVICE_ID)
+    {
+        return -1;
+    }
+
+    info->irq = read_sysfs_value(devdir, "irq", &val) == 0 ? (int)val : 0;
+    info->numa_node = read_sysfs_value(devdir, "numa_node", &val) == 0 ? (int)val : -1;
+
+    // first line of "resource" is BAR0: start end flags
+    char path[160];
+    unsigned long long start, end, flags;
+    snprintf(path, sizeof(path), "%s/resource", devdir);
+    fp = fopen(path, "r");
+    if (fp != NULL)
+    {
+        if (fscanf(fp, "%llx %llx %llx", &start, &end, &flags) == 3 && end > start)
+        {
+            info->bar_size = (U32)(end - start + 1);
+        }
+        fclose(fp);
+    }
+    return 0;
+}
+
+int enum_devices_sysfs(device_info_t *infos, int max)
+{
+    /**
+     * @description: list every HSM2 function using sysfs only
+     * @param: 
+     *          infos - filled with up to max entries
+     *          max - capacity of infos
+     * @return: int
+     *          number of cards found, at most max
+     */
+    DIR *dir;
+    struct dirent *entry;
+    int n = 0;
+
+    dir = opendir("/sys/bus/pci/devices");
+    if (dir == NULL)
+    {
+        printf("Open failed for '/sys/bus/pci/devices': errno %d, %s\n", errno, strerror(errno));
+        return 0;
+    }
+    while ((entry = readdir(dir)) != NULL && n < max)
+    {
+        if (entry->d_name[0] == '.')
+        {
+            continue;
+        }
+        if (probe_sysfs_device(entry->d_name, &infos[n]) == 0)
+        {
+            n++;
+        }
+    }
+    closedir(dir);
+    return n;
+}
+
+int open_device_bdf(const char *bdf, device_t **dev)
+{
+    device_info_t info;
+
+    if (probe_sysfs_device(bdf, &info) < 0)
+    {
+        printf("%s is not an HSM2 device (%04x:%04x)\n", bdf, HSM2_VENDOR_ID, HSM2_DEVICE_ID);
+        *dev = NULL;
+        return -1;
+    }
+    return open_device_at(&info, dev);
+}
+
+static void write_bdf_cache(const char *cache, const device_info_t *info)
+{
+    char tmp[256], line[32];
+    int fd, len, ok;
+
+    if (strcmp(cache, HSM2_BDF_CACHE) == 0)
+    {
+        mkdir(HSM2_BDF_CACHE_DIR, 0755);
+    }
+
+    // never follow or reuse a planted file: write a fresh one, then swap it in
+    snprintf(tmp, sizeof(tmp), "%s.%d", cache, (int)getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return;
+    }
+    len = snprintf(line, sizeof(line), "%04x:%02x:%02x.%1x\n", info->domain, info->bus, info->slot, info->function);
+    ok = write(fd, line, len) == len;
+    close(fd);
+    if (!ok || rename(tmp, cache) < 0)
+    {
+        unlink(tmp);
+    }
+}
+
+int open_device(device_t **dev)
+{
+    /**
+     * @description: open the configured, cached or first HSM2 card
+     * @param: 
+     *          dev - returned device
+     * @return: int
+     *          0 - success
+     *          -1 - no usable card
+     */
+    const char *bdf = getenv("HSM2_BDF");
+    const char *cache = getenv("HSM2_BDF_CACHE");
+    device_info_t info;
+    char cached[32];
+    FILE *fp;
+
+    if (sim_cards() > 0)
+    {
+        return open_device_sim(0, dev);
+    }
+    if (bdf != NULL)
+    {
+        return open_device_bdf(bdf, dev);
+    }
+    if (cache == NULL)
+    {
+        cache = HSM2_BDF_CACHE;
+    }
+
+    // last-known BDF, verified against sysfs before use
+    TRACE_BEGIN(t);
+    fp = fopen(cache, "r");
+    if (fp != NULL)
+    {
+        int hit = fscanf(fp, "%31s", cached) == 1 && probe_sysfs_device(cached, &info) == 0;
+        fclose(fp);
+        if (hit)
+        {
+            TRACE_END(t, SM2_PHASE_DISCOVER, 1);
+            return open_device_at(&info, dev);
+        }
+    }
+
+    int found = enum_devices_sysfs(&info, 1);
+    TRACE_END(t, SM2_PHASE_DISCOVER, 0);
+    if (found == 0)
+    {
+        printf("No HSM2 device (%04x:%04x) found\n", HSM2_VENDOR_ID, HSM2_DEVICE_ID);
+        *dev = NULL;
+        return -1;
+    }
+
+    write_bdf_cache(cache, &info);
+    return open_device_at(&info, dev);
+}
+
+int open_all_devices(device_t **devs, int max)
+{
+    /**
+     * @description: open every HSM2 card in the host
+     * @param: 
+     *          devs - filled with up to max opened cards
+     *          max - capacity of devs
+     * @return: int
+     *          number of cards opened
+     */
+    device_info_t infos[HSM2_MAX_DEVICES];
+    int sim = sim_cards();
+    int found, n = 0;
+
+    if (max > HSM2_MAX_DEVICES)
+    {
+        max = HSM2_MAX_DEVICES;
+    }
+    if (sim > 0)
+    {
+        // $HSM2_SIM simulated cards instead of the real ones
+        for (int i = 0; i < sim && n < max; i++)
+        {
+            if (open_device_sim(i, &devs[n]) == 0)
+            {
+                n++;
+            }
+        }
+        return n;
+    }
+    found = enum_devices(infos, max);
+    for (int i = 0; i < found; i++)
+    {
+        if (open_device_at(&infos[i], &devs[n]) == 0)
+        {
+            n++;
+        }
+    }
+    return n;
+}
+
+static device_t *alloc_device(const device_info_t *info)
+{
+    device_t *dev = (device_t *)malloc(sizeof(device_t));
+    if (dev == NULL)
+    {
+        return NULL;
+    }
+    memset(dev, 0, sizeof(device_t));
+
+    dev->domain = info->domain;
+    dev->bus = info->bus;
+    dev->slot = info->slot;
+    dev->function = info->function;
+    dev->irq = info->irq;
+    dev->numa_node = info->numa_node;
+    dev->irq_fd = -1;
+    dev->irq_wake[0] = dev->irq_wake[1] = -1;
+    dev->vfio_group = -1;
+    dev->vfio_container = -1;
+    dev->timeout_ns = SM2_DEFAULT_TIMEOUT_NS;
+    dev->read_width = 8;
+    // delta uploads are opt-in, firmware may use DATA words as scratch
+    device_set_shadow(dev, 0);
+    SM2_WaitPolicyDefault(&dev->wait);
+    return dev;
+}
+
+int open_device_at(const device_info_t *info, device_t **dev)
+{
+    TRACE_BEGIN(t);
+    *dev = alloc_device(info);
+    if (*dev == NULL)
+    {
+        return -1;
+    }
 
     // Convert to a sysfs resource filename and open the resource
     snprintf((*dev)->filename, 99, "/sys/bus/pci/devices/%04x:%02x:%02x.%1x/resource%d",
              (*dev)->domain, (*dev)->bus, (*dev)->slot, (*dev)->function, (*dev)->bar);
-    // snprintf((*dev)->filename, 99, "/sys/bus/pci/devices/%04x:%02x:%02x.%1x/resource%d",
-    //          0x0000, 0x07, 0x00, 0x00, 0x0);
     printf("fd: %s\n", (*dev)->filename);
 
     (*dev)->fd = open((*dev)->filename, O_RDWR | O_SYNC);
@@ -42,7 +369,7 @@ int open_device(device_t **dev)
     {
         printf("Open failed for file '%s': errno %d, %s\n",
                (*dev)->filename, errno, strerror(errno));
-        return -1;
+        goto fail_free;
     }
 
     // PCI memory size
@@ -51,7 +378,7 @@ int open_device(device_t **dev)
     if (status < 0)
     {
         printf("fstat() failed: errno %d, %s\n", errno, strerror(errno));
-        return -1;
+        goto fail_close;
     }
     (*dev)->size = statbuf.st_size;
 
@@ -62,10 +389,9 @@ int open_device(device_t **dev)
     {
         //		printf("failed (mmap returned MAP_FAILED)\n");
         printf("BARs that are I/O ports are not supported by this tool\n");
-        (*dev)->maddr = 0;
-        close((*dev)->fd);
-        return -1;
+        goto fail_close;
     }
+    TRACE_END(t, SM2_PHASE_MAP, 0);
 
     /* Device regions smaller than a 4k page in size can be offset
 	 * relative to the mapped base address. The offset is
@@ -75,16 +401,15 @@ int open_device(device_t **dev)
     char configname[100];
     int fd;
 
-    // snprintf(configname, 99, "/sys/bus/pci/devices/%04x:%02x:%02x.%1x/config",
-    //          (*dev)->domain, (*dev)->bus, (*dev)->slot, (*dev)->function);
+    TRACE_BEGIN(c);
     snprintf(configname, 99, "/sys/bus/pci/devices/%04x:%02x:%02x.%1x/config",
-             0x0000, 0x07, 0x00, 0x00);
+             (*dev)->domain, (*dev)->bus, (*dev)->slot, (*dev)->function);
     fd = open(configname, O_RDWR | O_SYNC);
-    if ((*dev)->fd < 0)
+    if (fd < 0)
     {
         printf("Open failed for file '%s': errno %d, %s\n",
                configname, errno, strerror(errno));
-        return -1;
+        goto fail_unmap;
     }
 
     status = lseek(fd, 0x10 + 4 * (*dev)->bar, SEEK_SET);
@@ -92,475 +417,4393 @@ int open_device(device_t **dev)
     {
         printf("Error: configuration space lseek failed\n");
         close(fd);
-        return -1;
+        goto fail_unmap;
     }
     status = read(fd, &((*dev)->phys), 4);
     if (status < 0)
     {
         printf("Error: configuration space read failed\n");
         close(fd);
-        return -1;
+        goto fail_unmap;
     }
     (*dev)->offset = (((*dev)->phys & 0xFFFFFFF0) % 0x1000);
     (*dev)->addr = (*dev)->maddr + (*dev)->offset;
     close(fd);
+    TRACE_END(c, SM2_PHASE_CONFIG, 0);
+
+    TRACE_BEGIN(m);
+    map_control_block(*dev);
+    map_stats_block(*dev);
+    TRACE_END(m, SM2_PHASE_SHM, 0);
+    HSM2_PROBE2(open, HSM2_BDF(*dev), (*dev)->size);
     printf("device opened!\n");
     return 0;
+
+fail_unmap:
+    munmap((*dev)->maddr, (*dev)->size);
+fail_close:
+    close((*dev)->fd);
+fail_free:
+    free(*dev);
+    *dev = NULL;
+    return -1;
 }
 
 void close_device(device_t *dev)
 {
+    if (dev->sim != NULL)
+    {
+        sim_stop(dev);
+    }
+    if (dev->wc_maddr != NULL)
+    {
+        munmap(dev->wc_maddr, dev->size);
+        close(dev->wc_fd);
+        free(dev->staging);
+    }
+    if (dev->shm != NULL)
+    {
+        munmap(dev->shm, sizeof(SM2_shm_t));
+    }
+    if (dev->stats != NULL)
+    {
+        munmap(dev->stats, sizeof(SM2_stats_t));
+    }
+    if (dev->irq_fd >= 0)
+    {
+        close(dev->irq_fd);
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        if (dev->irq_wake[i] >= 0)
+        {
+            close(dev->irq_wake[i]);
+        }
+    }
     munmap(dev->maddr, dev->size);
     close(dev->fd);
+    if (dev->vfio_group >= 0)
+    {
+        close(dev->vfio_group);
+        close(dev->vfio_container);
+    }
     free(dev);
 }
 
-void SM2_Init(device_t *dev, U32 base_addr)
+/* ----------------------------------------------------------------
+ * VFIO backend
+ *
+ * Maps BAR0 through a card bound to vfio-pci and routes the device
+ * interrupt (MSI-X, MSI or INTx, whichever the function offers) to
+ * an eventfd. Waiters then sleep in poll() on that eventfd instead
+ * of polling STATE; see wait_irq().
+ * ----------------------------------------------------------------
+ */
+static int vfio_set_irq(device_t *dev, U32 index, U32 action, int fd)
 {
-    /**
-     * @description: init HSM2
-     * @param: 
-     *          dev - pcie device
-     * @return: none
-     */
-
-    U32 addr, d32;
-
-    U32 SM2_in_code[512] = {
-        0x01000000, 0x01000100, 0x13000000, 0x0D0E1216, 0x0E3C2B40, 0x13000000, 0x0D1A2226, 0x0E3C2B40,
-        0x13000000, 0x0D0E1A1E, 0x0E382B80, 0x13000000, 0x02383803, 0x02393903, 0x0F000038, 0x103C2C00,
-        0x13000000, 0x113C383C, 0x13000000, 0x09000006, 0x09000108, 0x12003F3E, 0x0C36023E, 0x02373637,
-        0x02363737, 0x02373736, 0x023C3C36, 0x023D3D37, 0x023C3C2A, 0x023D3D2A, 0x12003C3C, 0x12003D3D,
-        0x13000000, 0x02363C03, 0x02373636, 0x02373637, 0x02363604, 0x05373736, 0x05373705, 0x02363D03,
-        0x02363636, 0x12003737, 0x12003636, 0x07373736, 0x12003737, 0x13000000, 0x01000001, 0x01000101,
-        0x13000000, 0x0900000A, 0x0900010C, 0x02362D01, 0x12013736, 0x0C360036, 0x02373637, 0x02372A37,
-        0x13000000, 0x02312D2F, 0x02313101, 0x0531312E, 0x12012C31, 0x02313130, 0x02313101, 0x12013131,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x01000000, 0x01000100, 0x13000000, 0x0D0E1216, 0x0E3C2B40, 0x13000000, 0x0D1A2226, 0x0E3C2B40,
-        0x13000000, 0x0D0E1A1E, 0x0E382B80, 0x13000000, 0x02383803, 0x02393903, 0x0F000038, 0x103C2C00,
-        0x13000000, 0x113C383C, 0x13000000, 0x09000006, 0x09000108, 0x12003F3E, 0x0C36023E, 0x02373637,
-        0x02363737, 0x02373736, 0x023C3C36, 0x023D3D37, 0x023C3C2A, 0x023D3D2A, 0x12003C3C, 0x12003D3D,
-        0x13000000, 0x02363C03, 0x02373636, 0x02373637, 0x02363604, 0x05373736, 0x05373705, 0x02363D03,
-        0x02363636, 0x12003737, 0x12003636, 0x07373736, 0x12003737, 0x13000000, 0x01000001, 0x01000101,
-        0x13000000, 0x0900000A, 0x0900010C, 0x02362D01, 0x12013736, 0x0C360036, 0x02373637, 0x02372A37,
-        0x13000000, 0x053C303C, 0x022F2F3C, 0x022F2F01, 0x0731312F, 0x02313137, 0x02313101, 0x12013C3C,
-        0x12013131, 0x13000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000};
-
-    U32 SM2_ex_code[256] = {
-        0x07010000, 0x0F000001, 0x0C000000, 0x19000000, 0x0B010001, 0x0D010000, 0x19000000, 0x012A3B00,
-        0x1C010200, 0x012B0100, 0x022B0200, 0x15000000, 0x17000000, 0x16000000, 0x18000000, 0x15060000,
-        0x17030000, 0x16000000, 0x18000000, 0x04383C00, 0x04393D00, 0x043A3E00, 0x043B3F00, 0x15110000,
-        0x16000000, 0x15130000, 0x16000000, 0x05013C00, 0x05023D00, 0x1B000000, 0x0F000037, 0x0C000000,
-        0x19000000, 0x1C030400, 0x012B0300, 0x022B0400, 0x15000000, 0x17000000, 0x16000000, 0x18000000,
-        0x15060000, 0x17030000, 0x16000000, 0x18000000, 0x04383C00, 0x04393D00, 0x043A3E00, 0x043B3F00,
-        0x0B030101, 0x022D0300, 0x02310000, 0x022F0100, 0x02300200, 0x15110000, 0x16000000, 0x15130000,
-        0x172E0000, 0x18000000, 0x17310000, 0x16000000, 0x18000000, 0x033C3C00, 0x17390000, 0x18000000,
-        0x06033C00, 0x0C030000, 0x19000000, 0x0F000003, 0x0C000000, 0x19000000, 0x06043100, 0x1B000000,
-        0x0C030000, 0x19000000, 0x0C040000, 0x19000000, 0x0D030000, 0x19000000, 0x0D040000, 0x19000000,
-        0x0F050304, 0x0C050000, 0x19000000, 0x0806053C, 0x0807053D, 0x022C0600, 0x012C0700, 0x02380000,
-        0x02390100, 0x01380000, 0x01390100, 0x012B0400, 0x15000000, 0x17000000, 0x16000000, 0x18000000,
-        0x170C0000, 0x150C0000, 0x16000000, 0x15090000, 0x16000000, 0x15110000, 0x16000000, 0x18000000,
-        0x04383C00, 0x04393D00, 0x043A3E00, 0x043B3F00, 0x15110000, 0x16000000, 0x012A3B00, 0x15130000,
-        0x16000000, 0x05053C00, 0x0F050502, 0x12050503, 0x0C050000, 0x1A000000, 0x1B000000, 0x07030000,
-        0x0F000300, 0x0C000000, 0x19000000, 0x0803003C, 0x0804003D, 0x022C0300, 0x012C0400, 0x02380100,
-        0x02390200, 0x01380100, 0x01390200, 0x012B0000, 0x15000000, 0x17000000, 0x16000000, 0x18000000,
-        0x170C0000, 0x150C0000, 0x16000000, 0x15090000, 0x16000000, 0x18000000, 0x03383C00, 0x03393D00,
-        0x033A3E00, 0x033B3F00, 0x17110000, 0x1E3C3800, 0x1E3D3900, 0x1E3E3A00, 0x1E3F3B00, 0x012A3B00,
-        0x18000000, 0x022A3B00, 0x15130000, 0x17130000, 0x16000000, 0x18000000, 0x17210000, 0x18000000,
-        0x06033700, 0x0C030000, 0x1A000000, 0x05033C00, 0x05043D00, 0x06053C00, 0x06063D00, 0x1B000000,
-        0x08030039, 0x0804003A, 0x022C0300, 0x012C0400, 0x02380100, 0x02390200, 0x01380100, 0x01390200,
-        0x013C0100, 0x013D0200, 0x15000000, 0x17000000, 0x16000000, 0x18000000, 0x15210000, 0x16000000,
-        0x05033700, 0x0C030000, 0x1A000000, 0x170C0000, 0x150C0000, 0x16000000, 0x18000000, 0x03383C00,
-        0x03393D00, 0x033A3E00, 0x033B3F00, 0x17110000, 0x18000000, 0x022A3B00, 0x17130000, 0x18000000,
-        0x06033C00, 0x06043D00, 0x1B000000, 0x023C0300, 0x023D0400, 0x013C0500, 0x013D0600, 0x15000000,
-        0x17000000, 0x16000000, 0x18000000, 0x15210000, 0x17210000, 0x16000000, 0x18000000, 0x06073700,
-        0x0C070000, 0x1A000000, 0x05073700, 0x0C070000, 0x1A000000, 0x08093F01, 0x09090938, 0x080A3F03,
-        0x090A0A38, 0x012D0000, 0x012E0200, 0x012F0900, 0x01300A00, 0x152E0000, 0x16000000, 0x15390000,
-        0x16000000, 0x032C3100, 0x01380500, 0x01390600, 0x02380300, 0x02390400, 0x15000000, 0x16000000,
-        0x150C0000, 0x170C0000, 0x16000000, 0x18000000, 0x03383C00, 0x03393D00, 0x033A3E00, 0x033B3F00,
-        0x17110000, 0x18000000, 0x022A3B00, 0x17130000, 0x18000000, 0x06073C00, 0x06083D00, 0x1B000000};
-
-    U32 SM2_Data[512] = {
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00008020,
-        0xFFFFFFFE, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0x00000000, 0xFFFFFFFF, 0xFFFFFFFF,
-        0xFFFFFFFC, 0x00000001, 0xFFFFFFFE, 0x00000000, 0xFFFFFFFF, 0x00000001, 0x00000000, 0x00000001,
-        0xFFFFFFFE, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0x7203DF6B, 0x21C6052B, 0x53BBF409, 0x39D54123,
-        0x6F39132F, 0x82E4C7BC, 0x2B0068D3, 0xB08941D4, 0xDF1E8D34, 0xFC8319A5, 0x327F9E88, 0x72350975,
-        0x00000004, 0x00000000, 0x00000000, 0x00000002, 0x37F08253, 0x78E7EB52, 0xB1102FDB, 0x18AAFB74,
-        0xEB5E412B, 0x22B3D3B6, 0x20FC84C3, 0xAFFE0D43, 0xD4412542, 0xC5342A7D, 0xAD5D36EE, 0x873FB0DD,
-        0x00000004, 0x00000000, 0x00000000, 0x00000000, 0x00000003, 0xFFFFFFFC, 0x00000000, 0x00000004,
-        0x00000040, 0x00000020, 0x00000010, 0x00000010, 0x0000002F, 0xFFFFFFF0, 0x00000020, 0x00000030,
-        0xFFFFFFF2, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFF3, 0x0000000C, 0xFFFFFFFF, 0xFFFFFFF3,
-        0x903F8622, 0xE8838B21, 0x49E60541, 0x7A9470F1, 0xC73CDE6B, 0xA6D4DEAE, 0x4348C18C, 0xAF037508,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000600, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00155555, 0x55555555, 0x55555555, 0x2AAAAAAA, 0xAAAAAAAA,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x0000052A, 0xAAAAAAAA, 0xAAAAAAAA,
-        0x55555555, 0x55555000, 0x00000555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555554,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x60000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x15555555, 0x55555555, 0x2AAAAAAA, 0xAAAAAAAA,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x50440924, 0xA8A88809,
-        0xAA952A24, 0xA4890142, 0xA08A4A55, 0x4AA01152, 0xAAAAAAAA, 0xAAAAAAAA, 0xAAAAAAAA, 0xAAAAAAAA,
-        0x4459E97D, 0x8704EC17, 0x5A87B666, 0xB0930F0C, 0xF9E607B9, 0x729B013F, 0x84CA2643, 0xD0600A7A,
-        0x8F359753, 0x075CD6F6, 0x3533EC19, 0xB8A923E3, 0x07D795E3, 0x34CA57EA, 0x04D53964, 0xF0B43775,
-        0x00000004, 0x00000000, 0x00000000, 0x00000000, 0x00000003, 0xFFFFFFFC, 0x00000000, 0x00000004,
-        0xFFFFFFF2, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFF3, 0x0000000C, 0xFFFFFFFF, 0xFFFFFFF3,
-        0xC09E1FE1, 0x4AA8A4FB, 0x34381262, 0xF203B2C1, 0x70407E79, 0x6437FECD, 0x2CCF8082, 0xEB60C348,
-        0x2C25A5C8, 0xF788C9E7, 0x700E80E2, 0x244EC4A3, 0x3D73AF83, 0xF83B8DDD, 0xFF5933B4, 0x883E3F21,
-        0x00000004, 0x00000000, 0x00000000, 0x00000000, 0x00000003, 0xFFFFFFFC, 0x00000000, 0x00000004,
-        0xFFFFFFF2, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFF3, 0x0000000C, 0xFFFFFFFF, 0xFFFFFFF3,
-        0x4471A7C5, 0x4CCA7D66, 0x5D96C92F, 0x533CCF43, 0xDF48A731, 0x187B7E95, 0xD3BA1388, 0xE6836771,
-        0xEC7A0511, 0x12D090E9, 0x18910872, 0x6609F928, 0xE91943C5, 0xE1FC3968, 0x04256EDE, 0x81EB8C59,
-        0x00000004, 0x00000000, 0x00000000, 0x00000000, 0x00000003, 0xFFFFFFFC, 0x00000000, 0x00000004,
-        0xFFFFFFF2, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFF3, 0x0000000C, 0xFFFFFFFF, 0xFFFFFFF3,
-        0x27994104, 0x5A2D3159, 0xA003DA59, 0x466D30D4, 0xAFDC4C3D, 0x45534DDA, 0xEE7D586A, 0x2A452D43,
-        0x8D5B3D1B, 0x30599D1C, 0x7FFE78F5, 0x0158B97D, 0xE0684BDC, 0x88473877, 0xC1C1B801, 0xB6628CC5,
-        0x00000004, 0x00000000, 0x00000000, 0x00000000, 0x00000003, 0xFFFFFFFC, 0x00000000, 0x00000004,
-        0xFFFFFFF2, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFF3, 0x0000000C, 0xFFFFFFFF, 0xFFFFFFF3,
-        0x7006BDA7, 0x8C0FBC93, 0xE82F5B00, 0x1FDF3AD4, 0xE0976032, 0x9BDD6C35, 0x5B1393CE, 0x25D46365,
-        0xBCD42201, 0x5A332E19, 0x464D8B1A, 0x54DCD086, 0x2FF9294D, 0x92373ABA, 0x75D73E79, 0xAFF2F249,
-        0x00000004, 0x00000000, 0x00000000, 0x00000000, 0x00000003, 0xFFFFFFFC, 0x00000000, 0x00000004,
-        0xFFFFFFF2, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFF3, 0x0000000C, 0xFFFFFFFF, 0xFFFFFFF3,
-        0x54910AD4, 0xFF79F940, 0x2D59190A, 0x1DC49448, 0x9527D593, 0xF5AEAE60, 0xECE64A90, 0x80AF78E7,
-        0xE8242565, 0x095C3079, 0xB6C3B762, 0x41B7B231, 0x6C653C2C, 0x20ECA6F5, 0x9B3BF422, 0x8F4F85B9,
-        0x00000004, 0x00000000, 0x00000000, 0x00000000, 0x00000003, 0xFFFFFFFC, 0x00000000, 0x00000004,
-        0xFFFFFFF2, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFF3, 0x0000000C, 0xFFFFFFFF, 0xFFFFFFF3,
-        0xC5DB0BE9, 0x0D2E255F, 0xCC849156, 0x8CE4163B, 0x82B475E7, 0x16B51C1E, 0xC95379BA, 0x017C3B63,
-        0x103AAF68, 0x6F39DEDB, 0x99816AA0, 0x36995785, 0xEBCDEAD9, 0xAA98A39F, 0xA90A9A4A, 0x458BFE12,
-        0x00000004, 0x00000000, 0x00000000, 0x00000000, 0x00000003, 0xFFFFFFFC, 0x00000000, 0x00000004,
-        0xFFFFFFF2, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFF3, 0x0000000C, 0xFFFFFFFF, 0xFFFFFFF3,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000001,
-        0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555,
-        0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555,
-        0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555,
-        0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555,
-        0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555,
-        0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555,
-        0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x80000000, 0x00000000, 0x00000000, 0x00000000,
-        0xffffffff, 0xffffffff, 0xfC000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x03ffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000001,
-        0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xfff00000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x000fffff, 0xffffffff,
-        0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-        0x00000000, 0x00000000, 0x00000000, 0x00000000, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff};
-
-    // Soft reset command
-    d32 = CMD_SOFTRST;
-    addr = base_addr + CMD_ADDR * sizeof(U32);
-    memcpy(dev->addr + addr, &d32, sizeof(U32) * 1);
-    msync((void *)(dev->addr + addr), sizeof(U32) * 1, MS_SYNC | MS_INVALIDATE);
-
-    // SM2_in_code
-    addr = base_addr + DATA_ADDR * sizeof(U32);
-    memcpy(dev->addr + addr, SM2_in_code, sizeof(U32) * 512);
-    msync((void *)(dev->addr + addr), sizeof(U32) * 512, MS_SYNC | MS_INVALIDATE);
-
-    // SM2_ex_code
-    addr = base_addr + PARAM_ADDR * sizeof(U32);
-    memcpy(dev->addr + addr, SM2_ex_code, sizeof(U32) * 256);
-    msync((void *)(dev->addr + addr), sizeof(U32) * 256, MS_SYNC | MS_INVALIDATE);
-
-    // Init command 1
-    d32 = CMD_INIT1;
-    addr = base_addr + CMD_ADDR * sizeof(U32);
-    memcpy(dev->addr + addr, &d32, sizeof(U32) * 1);
-    msync((void *)(dev->addr + addr), sizeof(U32) * 1, MS_SYNC | MS_INVALIDATE);
-    // sleep(2);
+    char buf[sizeof(struct vfio_irq_set) + sizeof(int)];
+    struct vfio_irq_set *irq_set = (struct vfio_irq_set *)buf;
 
-    // Wait for EBUSY signal
-    addr = base_addr + STATE_ADDR * sizeof(U32);
-    d32 = read_le32(dev, addr);
-    while (d32 & 1)
+    memset(buf, 0, sizeof(buf));
+    irq_set->argsz = sizeof(buf);
+    irq_set->index = index;
+    irq_set->start = 0;
+    irq_set->count = 1;
+    if (fd >= 0)
     {
-        d32 = read_le32(dev, addr);
+        irq_set->flags = VFIO_IRQ_SET_DATA_EVENTFD | action;
+        memcpy(irq_set->data, &fd, sizeof(int));
     }
+    else
+    {
+        irq_set->argsz = sizeof(struct vfio_irq_set);
+        irq_set->flags = VFIO_IRQ_SET_DATA_NONE | action;
+    }
+    return ioctl(dev->fd, VFIO_DEVICE_SET_IRQS, irq_set);
+}
 
-    // SM2_Data
-    addr = base_addr + DATA_ADDR * sizeof(U32);
-    memcpy(dev->addr + addr, SM2_Data, sizeof(U32) * 512);
-    msync((void *)(dev->addr + addr), sizeof(U32) * 512, MS_SYNC | MS_INVALIDATE);
-
-    // Init command 2
-    d32 = CMD_INIT2;
-    addr = base_addr + CMD_ADDR * sizeof(U32);
-    memcpy(dev->addr + addr, &d32, sizeof(U32) * 1);
-    msync((void *)(dev->addr + addr), sizeof(U32) * 1, MS_SYNC | MS_INVALIDATE);
+static int vfio_enable_irq(device_t *dev)
+{
+    const U32 indexes[3] = {VFIO_PCI_MSIX_IRQ_INDEX, VFIO_PCI_MSI_IRQ_INDEX, VFIO_PCI_INTX_IRQ_INDEX};
 
-    // Wait for EBUSY signal
-    addr = base_addr + STATE_ADDR * sizeof(U32);
-    d32 = read_le32(dev, addr);
-    while (d32 & 1)
+    dev->irq_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (dev->irq_fd < 0)
     {
-        d32 = read_le32(dev, addr);
+        printf("eventfd() failed: errno %d, %s\n", errno, strerror(errno));
+        return -1;
     }
-    printf("Initialization finished!\n");
+    for (int i = 0; i < 3; i++)
+    {
+        struct vfio_irq_info irq = {.argsz = sizeof(irq), .index = indexes[i]};
+        if (ioctl(dev->fd, VFIO_DEVICE_GET_IRQ_INFO, &irq) < 0 || irq.count == 0)
+        {
+            continue;
+        }
+        if (vfio_set_irq(dev, indexes[i], VFIO_IRQ_SET_ACTION_TRIGGER, dev->irq_fd) == 0)
+        {
+            dev->irq_index = indexes[i];
+            irq_wake_open(dev);
+            return 0;
+        }
+    }
+    printf("No usable interrupt on %04x:%02x:%02x.%1x\n", dev->domain, dev->bus, dev->slot, dev->function);
+    close(dev->irq_fd);
+    dev->irq_fd = -1;
+    return -1;
 }
 
-int SM2_GenKey(device_t *dev, U32 base_addr, U32 *rand, U32 *pri_key, U32 *pub_key)
+int open_device_vfio(const char *bdf, device_t **dev)
 {
     /**
-     * @description: generate key pair
+     * @description: open a card bound to vfio-pci, with interrupt completion
      * @param: 
-     *          dev - pcie device
-     *          rand - random number sequence, 32 * 8
-     *          pri_key - private key, 32 * 8
-     *          pub_key - public key, 32 * 16 
+     *          bdf - card address, e.g. "0000:07:00.0"
+     *          dev - returned device
      * @return: int
-     *          0 - success
-     *          1 - random number false 
+     *          0 - success, irq_fd is -1 if no interrupt could be enabled
+     *          -1 - not an HSM2 card, not bound to vfio-pci or mapping failed
      */
+    device_info_t info;
+    char path[128], link[128];
+    int group;
+    ssize_t len;
 
-    U32 addr, d32;
-    // write random number sequence
-    addr = base_addr + DATA_ADDR * sizeof(U32);
-    memcpy(dev->addr + addr, rand, sizeof(U32) * 8);
-    msync((void *)(dev->addr + addr), sizeof(U32) * 8, MS_SYNC | MS_INVALIDATE);
+    *dev = NULL;
+    if (probe_sysfs_device(bdf, &info) < 0)
+    {
+        printf("%s is not an HSM2 device (%04x:%04x)\n", bdf, HSM2_VENDOR_ID, HSM2_DEVICE_ID);
+        return -1;
+    }
 
-    // write start command
-    d32 = CMD_GENKEY;
-    addr = base_addr + CMD_ADDR * sizeof(U32);
-    memcpy(dev->addr + addr, &d32, sizeof(U32) * 1);
-    msync((void *)(dev->addr + addr), sizeof(U32) * 1, MS_SYNC | MS_INVALIDATE);
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%04x:%02x:%02x.%1x/iommu_group",
+             info.domain, info.bus, info.slot, info.function);
+    len = readlink(path, link, sizeof(link) - 1);
+    if (len < 0)
+    {
+        printf("No IOMMU group for %s: errno %d, %s\n", bdf, errno, strerror(errno));
+        return -1;
+    }
+    link[len] = 0;
+    group = atoi(strrchr(link, '/') + 1);
 
-    // Wait for EBUSY signal
-    addr = base_addr + STATE_ADDR * sizeof(U32);
-    d32 = read_le32(dev, addr);
-    while (d32 & 1)
+    device_t *d = alloc_device(&info);
+    if (d == NULL)
     {
-        d32 = read_le32(dev, addr);
+        return -1;
+    }
+    d->fd = -1;
+    d->vfio_container = open("/dev/vfio/vfio", O_RDWR);
+    snprintf(d->filename, 99, "/dev/vfio/%d", group);
+    d->vfio_group = open(d->filename, O_RDWR);
+    if (d->vfio_container < 0 || d->vfio_group < 0)
+    {
+        printf("Open failed for VFIO group '%s': errno %d, %s\n", d->filename, errno, strerror(errno));
+        goto fail;
     }
-    int check = d32 & 2;
 
-    // read private key
-    addr = base_addr + DATA_ADDR * sizeof(U32);
-    memcpy(pri_key, dev->addr + addr, sizeof(U32) * 8);
+    struct vfio_group_status status = {.argsz = sizeof(status)};
+    if (ioctl(d->vfio_container, VFIO_GET_API_VERSION) != VFIO_API_VERSION ||
+        ioctl(d->vfio_group, VFIO_GROUP_GET_STATUS, &status) < 0 ||
+        !(status.flags & VFIO_GROUP_FLAGS_VIABLE) ||
+        ioctl(d->vfio_group, VFIO_GROUP_SET_CONTAINER, &d->vfio_container) < 0)
+    {
+        printf("VFIO group %d is not usable, are all its devices bound to vfio-pci?\n", group);
+        goto fail;
+    }
+    if (ioctl(d->vfio_container, VFIO_SET_IOMMU, VFIO_TYPE1v2_IOMMU) < 0 &&
+        ioctl(d->vfio_container, VFIO_SET_IOMMU, VFIO_NOIOMMU_IOMMU) < 0)
+    {
+        printf("VFIO_SET_IOMMU failed: errno %d, %s\n", errno, strerror(errno));
+        goto fail;
+    }
+
+    snprintf(path, sizeof(path), "%04x:%02x:%02x.%1x", info.domain, info.bus, info.slot, info.function);
+    d->fd = ioctl(d->vfio_group, VFIO_GROUP_GET_DEVICE_FD, path);
+    if (d->fd < 0)
+    {
+        printf("VFIO_GROUP_GET_DEVICE_FD failed: errno %d, %s\n", errno, strerror(errno));
+        goto fail;
+    }
+
+    struct vfio_region_info region = {.argsz = sizeof(region), .index = VFIO_PCI_BAR0_REGION_INDEX + d->bar};
+    if (ioctl(d->fd, VFIO_DEVICE_GET_REGION_INFO, &region) < 0 || !(region.flags & VFIO_REGION_INFO_FLAG_MMAP))
+    {
+        printf("BAR%d of %s cannot be mapped through VFIO\n", d->bar, bdf);
+        goto fail;
+    }
+    d->size = region.size;
+    d->maddr = (U8 *)mmap(NULL, d->size, PROT_READ | PROT_WRITE, MAP_SHARED, d->fd, region.offset);
+    if (d->maddr == (U8 *)MAP_FAILED)
+    {
+        printf("mmap() of BAR%d failed: errno %d, %s\n", d->bar, errno, strerror(errno));
+        goto fail;
+    }
+    d->addr = d->maddr;
 
-    // read public key
-    addr += sizeof(U32) * 8;
-    memcpy(pub_key, dev->addr + addr, sizeof(U32) * 16);
+    vfio_enable_irq(d);
+    map_control_block(d);
+    map_stats_block(d);
+    HSM2_PROBE2(open, HSM2_BDF(d), d->size);
+    printf("device opened through VFIO group %d, irq eventfd %d\n", group, d->irq_fd);
+    *dev = d;
+    return 0;
 
-    return check;
+fail:
+    if (d->fd >= 0)
+    {
+        close(d->fd);
+    }
+    if (d->vfio_group >= 0)
+    {
+        close(d->vfio_group);
+    }
+    if (d->vfio_container >= 0)
+    {
+        close(d->vfio_container);
+    }
+    free(d);
+    return -1;
 }
 
-int SM2_Sign(device_t *dev, U32 base_addr, U32 *rand, U32 *pri_key, U32 *hash, U32 *sign)
+int device_attach_eventfd(device_t *dev, int fd)
 {
     /**
-     * @description: signature
-     * @param: 
-     *          dev - pcie device
-     *          rand - random number sequence, 32 * 8
-     *          pri_key - private key, 32 * 8
-     *          hash - hash value, 32 * 8
-     *          sign - sign result(r, s), 32 * 16 
+     * @description: use an externally raised eventfd as completion interrupt,
+     *               e.g. one signalled by a simulated device
      * @return: int
      *          0 - success
-     *          1 - random number false or
-     *              r = 0 mod n or
+     */
+    if (dev->irq_fd >= 0)
+    {
+        close(dev->irq_fd);
+    }
+    dev->irq_fd = fd;
+    dev->irq_index = -1;
+    if (fd >= 0)
+    {
+        irq_wake_open(dev);
+    }
+    return 0;
+}
+
+static void irq_wake_open(device_t *dev)
+{
+    // without them a waiter whose wakeup was drained sleeps out the backstop
+    for (int i = 0; i < 2; i++)
+    {
+        if (dev->irq_wake[i] < 0)
+        {
+            dev->irq_wake[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        }
+    }
+}
+
+static int irq_consume(device_t *dev, U32 base_addr)
+{
+    /**
+     * @description: drain the device eventfd; both engines share it, so
+     *               the interrupt may be the other engine's completion and
+     *               its waiter is woken through irq_wake to re-read STATE
+     * @return: int
+     *          1 - the interrupt had fired
+     *          0 - nothing pending
+     */
+    int other = dev->irq_wake[ENGINE_INDEX(base_addr) ^ 1];
+    U64 count, one = 1;
+
+    if (read(dev->irq_fd, &count, sizeof(count)) != sizeof(count))
+    {
+        return 0;
+    }
+    if (dev->irq_index == VFIO_PCI_INTX_IRQ_INDEX)
+    {
+        // INTx stays masked after it fires until we unmask it
+        vfio_set_irq(dev, VFIO_PCI_INTX_IRQ_INDEX, VFIO_IRQ_SET_ACTION_UNMASK, -1);
+    }
+    if (other >= 0 && write(other, &one, sizeof(one)) < 0)
+    {
+        // the counter only saturates, a wakeup is already pending
+    }
+    return 1;
+}
+
+static void wait_irq(device_t *dev, U32 base_addr)
+{
+    struct pollfd pfd[2] = {{.fd = dev->irq_fd, .events = POLLIN},
+                            {.fd = dev->irq_wake[ENGINE_INDEX(base_addr)], .events = POLLIN}};
+    U64 count;
+
+    // the backstop only matters if an interrupt is lost altogether
+    poll(pfd, pfd[1].fd >= 0 ? 2 : 1, SM2_IRQ_BACKSTOP_MS);
+    if (pfd[1].fd >= 0 && read(pfd[1].fd, &count, sizeof(count)) < 0)
+    {
+        // no wakeup passed on from the other engine
+    }
+    irq_consume(dev, base_addr);
+}
+
+static void irq_probe(device_t *dev, U32 base_addr)
+{
+    /**
+     * @description: after a completion found by polling, check whether the
+     *               device raised its interrupt for it; the first time it
+     *               has, switch the wait policy over to sleeping on it
+     */
+    struct pollfd pfd = {.fd = dev->irq_fd, .events = POLLIN};
+
+    // any thread of any engine may get here
+    if (__atomic_load_n(&dev->irq_seen, __ATOMIC_RELAXED) || dev->irq_fd < 0 ||
+        __atomic_fetch_add(&dev->irq_probes, 1, __ATOMIC_RELAXED) >= SM2_IRQ_PROBES)
+    {
+        return;
+    }
+    if (poll(&pfd, 1, 0) != 1 || !irq_consume(dev, base_addr))
+    {
+        return;
+    }
+    __atomic_store_n(&dev->irq_seen, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&dev->wait.use_irq, 1, __ATOMIC_RELAXED);
+}
+
+/* ----------------------------------------------------------------
+ * Per-card control block
+ *
+ * A small POSIX shared-memory segment, /dev/shm/hsm2-<BDF>, that
+ * outlives the process. It records which image each engine holds so
+ * that a restarted process can skip the microcode and curve-table
+ * reload. The record is tied to the kernel boot_id and is cleared
+ * for the duration of every SM2_Init().
+ *
+ * It also holds one robust, process-shared mutex per engine. Whoever
+ * holds it owns the engine's DATA window and is the only one allowed
+ * to load its image, so processes sharing a card neither interleave
+ * uploads nor soft-reset each other.
+ * ----------------------------------------------------------------
+ */
+static void read_boot_id(char *boot_id, size_t len)
+{
+    FILE *fp = fopen("/proc/sys/kernel/random/boot_id", "r");
+    memset(boot_id, 0, len);
+    if (fp != NULL)
+    {
+        if (fgets(boot_id, len, fp) == NULL)
+        {
+            boot_id[0] = 0;
+        }
+        fclose(fp);
+    }
+}
+
+static int shm_trusted(int fd, const char *name)
+{
+    /**
+     * @description: vet a /dev/shm segment before mapping it; another user
+     *               may have created it first, with contents of their choosing
+     * @return: int
+     *          0 - owned by this user, mode no wider than HSM2_SHM_MODE
+     *          -1 - refused, the caller runs without the segment
+     */
+    struct stat st;
+
+    if (fchmod(fd, HSM2_SHM_MODE) < 0 || fstat(fd, &st) < 0)
+    {
+        printf("Cannot secure '%s': errno %d, %s\n", name, errno, strerror(errno));
+        return -1;
+    }
+    if (st.st_uid != geteuid() || ((st.st_mode & 0777) & ~HSM2_SHM_MODE) != 0)
+    {
+        printf("Ignoring '%s': owned by uid %d with mode %03o\n", name, (int)st.st_uid, (unsigned)(st.st_mode & 0777));
+        return -1;
+    }
+    return 0;
+}
+
+static void control_block_reset(SM2_shm_t *shm, const char *boot_id)
+{
+    pthread_mutexattr_t attr;
+
+    memset(shm, 0, sizeof(SM2_shm_t));
+    memcpy(shm->boot_id, boot_id, sizeof(shm->boot_id));
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (int i = 0; i < 2; i++)
+    {
+        pthread_mutex_init(&shm->engine_lock[i], &attr);
+    }
+    pthread_mutexattr_destroy(&attr);
+    shm->version = SM2_SHM_VERSION;
+    shm->magic = SM2_SHM_MAGIC;
+}
+
+static void map_control_block(device_t *dev)
+{
+    char name[64], boot_id[40];
+    int fd;
+
+    snprintf(name, sizeof(name), "/hsm2-%04x:%02x:%02x.%1x",
+             dev->domain, dev->bus, dev->slot, dev->function);
+    fd = shm_open(name, O_RDWR | O_CREAT, HSM2_SHM_MODE);
+    if (fd < 0)
+    {
+        printf("shm_open() of '%s' failed: errno %d, %s\n", name, errno, strerror(errno));
+        return;
+    }
+    // the engine mutexes and image CRCs must not be writable by other users, whatever the umask
+    if (shm_trusted(fd, name) < 0)
+    {
+        close(fd);
+        return;
+    }
+    if (ftruncate(fd, sizeof(SM2_shm_t)) < 0)
+    {
+        printf("ftruncate() of '%s' failed: errno %d, %s\n", name, errno, strerror(errno));
+        close(fd);
+        return;
+    }
+    dev->shm = (SM2_shm_t *)mmap(NULL, sizeof(SM2_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (dev->shm == (SM2_shm_t *)MAP_FAILED)
+    {
+        dev->shm = NULL;
+        close(fd);
+        return;
+    }
+
+    // a new segment, or one left over from before a reboot, says nothing about the engines;
+    // the flock keeps two processes from setting it up at the same time
+    flock(fd, LOCK_EX);
+    read_boot_id(boot_id, sizeof(boot_id));
+    if (dev->shm->magic != SM2_SHM_MAGIC || dev->shm->version != SM2_SHM_VERSION ||
+        strncmp(dev->shm->boot_id, boot_id, sizeof(boot_id)) != 0)
+    {
+        control_block_reset(dev->shm, boot_id);
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+static int lock_engine(device_t *dev, U32 base_addr, int block)
+{
+    pthread_mutex_t *lock;
+    int status;
+
+    if (dev->shm == NULL)
+    {
+        return 0;
+    }
+    lock = &dev->shm->engine_lock[ENGINE_INDEX(base_addr)];
+    status = block ? pthread_mutex_lock(lock) : pthread_mutex_trylock(lock);
+    if (status == EOWNERDEAD)
+    {
+        // the previous owner died holding the engine; let its last command finish
+        pthread_mutex_consistent(lock);
+        wait_idle(dev, base_addr, 0, 0, SM2_Deadline(dev->timeout_ns));
+        shadow_invalidate(dev, base_addr);
+        status = 0;
+    }
+    return status == 0 ? 0 : -1;
+}
+
+int device_lock_engine(device_t *dev, U32 base_addr)
+{
+    /**
+     * @description: take an engine for this process, waiting for other processes;
+     *               the lock is robust and belongs to the calling thread, so
+     *               device_unlock_engine() must be called from the same thread
+     * @return: int
+     *          0 - engine owned until device_unlock_engine()
+     *          -1 - lock failed
+     */
+    return lock_engine(dev, base_addr, 1);
+}
+
+int device_trylock_engine(device_t *dev, U32 base_addr)
+{
+    return lock_engine(dev, base_addr, 0);
+}
+
+void device_unlock_engine(device_t *dev, U32 base_addr)
+{
+    if (dev->shm != NULL &&
+        pthread_mutex_unlock(&dev->shm->engine_lock[ENGINE_INDEX(base_addr)]) == EPERM)
+    {
+        // the lock stays with the thread that took it, and the engine with it
+        printf("Engine %d unlocked by a thread that does not own it\n", ENGINE_INDEX(base_addr));
+    }
+}
+
+/* ----------------------------------------------------------------
+ * Shared statistics
+ *
+ * A second segment, /dev/shm/hsm2-stats-<BDF>, collects per-engine,
+ * per-opcode counters and HDR latency histograms from every process
+ * using the card. Writers add to them with relaxed atomics and no
+ * lock. The segment holds no mutex of its own, so monitoring tools
+ * map it read-only with SM2_StatsMap() and can never stall an
+ * operation. Counters only grow; readers work with differences.
+ * Latencies run from the command write to the first STATE read that
+ * found the engine idle, so they include how the caller waited. Init
+ * commands count under SM2_OP_INIT. The segment gets HSM2_SHM_MODE,
+ * so a scraper running as another user needs a group-readable build.
+ * ----------------------------------------------------------------
+ */
+static void map_stats_block(device_t *dev)
+{
+    char name[64];
+    int fd;
+
+    snprintf(name, sizeof(name), "/hsm2-stats-%04x:%02x:%02x.%1x",
+             dev->domain, dev->bus, dev->slot, dev->function);
+    fd = shm_open(name, O_RDWR | O_CREAT, HSM2_SHM_MODE);
+    if (fd < 0)
+    {
+        printf("shm_open() of '%s' failed: errno %d, %s\n", name, errno, strerror(errno));
+        return;
+    }
+    // writable by every user would let anyone forge the counters
+    if (shm_trusted(fd, name) < 0)
+    {
+        close(fd);
+        return;
+    }
+    if (ftruncate(fd, sizeof(SM2_stats_t)) < 0)
+    {
+        printf("ftruncate() of '%s' failed: errno %d, %s\n", name, errno, strerror(errno));
+        close(fd);
+        return;
+    }
+    dev->stats = (SM2_stats_t *)mmap(NULL, sizeof(SM2_stats_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (dev->stats == (SM2_stats_t *)MAP_FAILED)
+    {
+        dev->stats = NULL;
+        close(fd);
+        return;
+    }
+
+    flock(fd, LOCK_EX);
+    if (dev->stats->magic != SM2_STATS_MAGIC || dev->stats->version != SM2_STATS_VERSION)
+    {
+        memset(dev->stats, 0, sizeof(SM2_stats_t));
+        snprintf(dev->stats->bdf, sizeof(dev->stats->bdf), "%04x:%02x:%02x.%1x",
+                 dev->domain, dev->bus, dev->slot, dev->function);
+        dev->stats->version = SM2_STATS_VERSION;
+        dev->stats->magic = SM2_STATS_MAGIC;
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+SM2_stats_t *SM2_StatsMap(const char *name)
+{
+    /**
+     * @description: map a card's statistics read-only
+     * @param: 
+     *          name - shm name, e.g. "/hsm2-stats-0000:01:00.0"
+     * @return: SM2_stats_t *
+     *          NULL - no such segment, or not a statistics segment
+     */
+    SM2_stats_t *stats;
+    struct stat st;
+    int fd = shm_open(name, O_RDONLY, 0);
+
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size != sizeof(SM2_stats_t))
+    {
+        close(fd);
+        return NULL;
+    }
+    stats = (SM2_stats_t *)mmap(NULL, sizeof(SM2_stats_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (stats == (SM2_stats_t *)MAP_FAILED)
+    {
+        return NULL;
+    }
+    if (stats->magic != SM2_STATS_MAGIC || stats->version != SM2_STATS_VERSION)
+    {
+        munmap(stats, sizeof(SM2_stats_t));
+        return NULL;
+    }
+    return stats;
+}
+
+void SM2_StatsUnmap(SM2_stats_t *stats)
+{
+    munmap(stats, sizeof(SM2_stats_t));
+}
+
+int SM2_HistBucket(U64 ns)
+{
+    /**
+     * @description: histogram bucket of a latency; exact below 8 ns,
+     *               then 8 buckets per power of two
+     */
+    if (ns < (1 << SM2_HIST_SUB_BITS))
+    {
+        return (int)ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    int bucket = ((msb - SM2_HIST_SUB_BITS + 1) << SM2_HIST_SUB_BITS) +
+                 (int)((ns >> (msb - SM2_HIST_SUB_BITS)) & ((1 << SM2_HIST_SUB_BITS) - 1));
+    return bucket < SM2_HIST_BUCKETS ? bucket : SM2_HIST_BUCKETS - 1;
+}
+
+U64 SM2_HistLower(int bucket)
+{
+    /**
+     * @description: smallest latency in ns that falls into a bucket
+     */
+    if (bucket < (1 << SM2_HIST_SUB_BITS))
+    {
+        return bucket;
+    }
+    int shift = (bucket >> SM2_HIST_SUB_BITS) - 1;
+    U64 sub = bucket & ((1 << SM2_HIST_SUB_BITS) - 1);
+    return ((1ULL << SM2_HIST_SUB_BITS) + sub) << shift;
+}
+
+static void stats_complete(device_t *dev, U32 base_addr, U32 cmd, U64 issued_ns, U32 d32)
+{
+    if (dev->stats == NULL)
+    {
+        return;
+    }
+    SM2_op_stats_t *s = &dev->stats->op[ENGINE_INDEX(base_addr)][op_index(cmd)];
+    U64 busy = issued_ns != 0 ? now_ns() - issued_ns : 0;
+
+    __atomic_fetch_add(&s->ops, 1, __ATOMIC_RELAXED);
+    if (d32 & 2)
+    {
+        __atomic_fetch_add(&s->errors, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&s->busy_ns, busy, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->hist[SM2_HistBucket(busy)], 1, __ATOMIC_RELAXED);
+}
+
+static void stats_polls(device_t *dev, U32 base_addr, U32 cmd, U32 polls)
+{
+    if (dev->stats != NULL && polls != 0)
+    {
+        __atomic_fetch_add(&dev->stats->op[ENGINE_INDEX(base_addr)][op_index(cmd)].polls, polls, __ATOMIC_RELAXED);
+    }
+}
+
+static void stats_timeout(device_t *dev, U32 base_addr, U32 cmd)
+{
+    if (dev->stats != NULL)
+    {
+        __atomic_fetch_add(&dev->stats->op[ENGINE_INDEX(base_addr)][op_index(cmd)].timeouts, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static U32 crc32_update(U32 crc, const void *buf, size_t len)
+{
+    const U8 *p = (const U8 *)buf;
+
+    crc = ~crc;
+    while (len--)
+    {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++)
+        {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+/* Built-in image: engine microcode and SM2 curve tables */
+static const U32 SM2_in_code[SM2_IN_CODE_WORDS] = {
+    0x01000000, 0x01000100, 0x13000000, 0x0D0E1216, 0x0E3C2B40, 0x13000000, 0x0D1A2226, 0x0E3C2B40,
+    0x13000000, 0x0D0E1A1E, 0x0E382B80, 0x13000000, 0x02383803, 0x02393903, 0x0F000038, 0x103C2C00,
+    0x13000000, 0x113C383C, 0x13000000, 0x09000006, 0x09000108, 0x12003F3E, 0x0C36023E, 0x02373637,
+    0x02363737, 0x02373736, 0x023C3C36, 0x023D3D37, 0x023C3C2A, 0x023D3D2A, 0x12003C3C, 0x12003D3D,
+    0x13000000, 0x02363C03, 0x02373636, 0x02373637, 0x02363604, 0x05373736, 0x05373705, 0x02363D03,
+    0x02363636, 0x12003737, 0x12003636, 0x07373736, 0x12003737, 0x13000000, 0x01000001, 0x01000101,
+    0x13000000, 0x0900000A, 0x0900010C, 0x02362D01, 0x12013736, 0x0C360036, 0x02373637, 0x02372A37,
+    0x13000000, 0x02312D2F, 0x02313101, 0x0531312E, 0x12012C31, 0x02313130, 0x02313101, 0x12013131,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x01000000, 0x01000100, 0x13000000, 0x0D0E1216, 0x0E3C2B40, 0x13000000, 0x0D1A2226, 0x0E3C2B40,
+    0x13000000, 0x0D0E1A1E, 0x0E382B80, 0x13000000, 0x02383803, 0x02393903, 0x0F000038, 0x103C2C00,
+    0x13000000, 0x113C383C, 0x13000000, 0x09000006, 0x09000108, 0x12003F3E, 0x0C36023E, 0x02373637,
+    0x02363737, 0x02373736, 0x023C3C36, 0x023D3D37, 0x023C3C2A, 0x023D3D2A, 0x12003C3C, 0x12003D3D,
+    0x13000000, 0x02363C03, 0x02373636, 0x02373637, 0x02363604, 0x05373736, 0x05373705, 0x02363D03,
+    0x02363636, 0x12003737, 0x12003636, 0x07373736, 0x12003737, 0x13000000, 0x01000001, 0x01000101,
+    0x13000000, 0x0900000A, 0x0900010C, 0x02362D01, 0x12013736, 0x0C360036, 0x02373637, 0x02372A37,
+    0x13000000, 0x053C303C, 0x022F2F3C, 0x022F2F01, 0x0731312F, 0x02313137, 0x02313101, 0x12013C3C,
+    0x12013131, 0x13000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000};
+
+static const U32 SM2_ex_code[SM2_EX_CODE_WORDS] = {
+    0x07010000, 0x0F000001, 0x0C000000, 0x19000000, 0x0B010001, 0x0D010000, 0x19000000, 0x012A3B00,
+    0x1C010200, 0x012B0100, 0x022B0200, 0x15000000, 0x17000000, 0x16000000, 0x18000000, 0x15060000,
+    0x17030000, 0x16000000, 0x18000000, 0x04383C00, 0x04393D00, 0x043A3E00, 0x043B3F00, 0x15110000,
+    0x16000000, 0x15130000, 0x16000000, 0x05013C00, 0x05023D00, 0x1B000000, 0x0F000037, 0x0C000000,
+    0x19000000, 0x1C030400, 0x012B0300, 0x022B0400, 0x15000000, 0x17000000, 0x16000000, 0x18000000,
+    0x15060000, 0x17030000, 0x16000000, 0x18000000, 0x04383C00, 0x04393D00, 0x043A3E00, 0x043B3F00,
+    0x0B030101, 0x022D0300, 0x02310000, 0x022F0100, 0x02300200, 0x15110000, 0x16000000, 0x15130000,
+    0x172E0000, 0x18000000, 0x17310000, 0x16000000, 0x18000000, 0x033C3C00, 0x17390000, 0x18000000,
+    0x06033C00, 0x0C030000, 0x19000000, 0x0F000003, 0x0C000000, 0x19000000, 0x06043100, 0x1B000000,
+    0x0C030000, 0x19000000, 0x0C040000, 0x19000000, 0x0D030000, 0x19000000, 0x0D040000, 0x19000000,
+    0x0F050304, 0x0C050000, 0x19000000, 0x0806053C, 0x0807053D, 0x022C0600, 0x012C0700, 0x02380000,
+    0x02390100, 0x01380000, 0x01390100, 0x012B0400, 0x15000000, 0x17000000, 0x16000000, 0x18000000,
+    0x170C0000, 0x150C0000, 0x16000000, 0x15090000, 0x16000000, 0x15110000, 0x16000000, 0x18000000,
+    0x04383C00, 0x04393D00, 0x043A3E00, 0x043B3F00, 0x15110000, 0x16000000, 0x012A3B00, 0x15130000,
+    0x16000000, 0x05053C00, 0x0F050502, 0x12050503, 0x0C050000, 0x1A000000, 0x1B000000, 0x07030000,
+    0x0F000300, 0x0C000000, 0x19000000, 0x0803003C, 0x0804003D, 0x022C0300, 0x012C0400, 0x02380100,
+    0x02390200, 0x01380100, 0x01390200, 0x012B0000, 0x15000000, 0x17000000, 0x16000000, 0x18000000,
+    0x170C0000, 0x150C0000, 0x16000000, 0x15090000, 0x16000000, 0x18000000, 0x03383C00, 0x03393D00,
+    0x033A3E00, 0x033B3F00, 0x17110000, 0x1E3C3800, 0x1E3D3900, 0x1E3E3A00, 0x1E3F3B00, 0x012A3B00,
+    0x18000000, 0x022A3B00, 0x15130000, 0x17130000, 0x16000000, 0x18000000, 0x17210000, 0x18000000,
+    0x06033700, 0x0C030000, 0x1A000000, 0x05033C00, 0x05043D00, 0x06053C00, 0x06063D00, 0x1B000000,
+    0x08030039, 0x0804003A, 0x022C0300, 0x012C0400, 0x02380100, 0x02390200, 0x01380100, 0x01390200,
+    0x013C0100, 0x013D0200, 0x15000000, 0x17000000, 0x16000000, 0x18000000, 0x15210000, 0x16000000,
+    0x05033700, 0x0C030000, 0x1A000000, 0x170C0000, 0x150C0000, 0x16000000, 0x18000000, 0x03383C00,
+    0x03393D00, 0x033A3E00, 0x033B3F00, 0x17110000, 0x18000000, 0x022A3B00, 0x17130000, 0x18000000,
+    0x06033C00, 0x06043D00, 0x1B000000, 0x023C0300, 0x023D0400, 0x013C0500, 0x013D0600, 0x15000000,
+    0x17000000, 0x16000000, 0x18000000, 0x15210000, 0x17210000, 0x16000000, 0x18000000, 0x06073700,
+    0x0C070000, 0x1A000000, 0x05073700, 0x0C070000, 0x1A000000, 0x08093F01, 0x09090938, 0x080A3F03,
+    0x090A0A38, 0x012D0000, 0x012E0200, 0x012F0900, 0x01300A00, 0x152E0000, 0x16000000, 0x15390000,
+    0x16000000, 0x032C3100, 0x01380500, 0x01390600, 0x02380300, 0x02390400, 0x15000000, 0x16000000,
+    0x150C0000, 0x170C0000, 0x16000000, 0x18000000, 0x03383C00, 0x03393D00, 0x033A3E00, 0x033B3F00,
+    0x17110000, 0x18000000, 0x022A3B00, 0x17130000, 0x18000000, 0x06073C00, 0x06083D00, 0x1B000000};
+
+static const U32 SM2_Data[SM2_DATA_WORDS] = {
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00008020,
+    0xFFFFFFFE, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0x00000000, 0xFFFFFFFF, 0xFFFFFFFF,
+    0xFFFFFFFC, 0x00000001, 0xFFFFFFFE, 0x00000000, 0xFFFFFFFF, 0x00000001, 0x00000000, 0x00000001,
+    0xFFFFFFFE, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0x7203DF6B, 0x21C6052B, 0x53BBF409, 0x39D54123,
+    0x6F39132F, 0x82E4C7BC, 0x2B0068D3, 0xB08941D4, 0xDF1E8D34, 0xFC8319A5, 0x327F9E88, 0x72350975,
+    0x00000004, 0x00000000, 0x00000000, 0x00000002, 0x37F08253, 0x78E7EB52, 0xB1102FDB, 0x18AAFB74,
+    0xEB5E412B, 0x22B3D3B6, 0x20FC84C3, 0xAFFE0D43, 0xD4412542, 0xC5342A7D, 0xAD5D36EE, 0x873FB0DD,
+    0x00000004, 0x00000000, 0x00000000, 0x00000000, 0x00000003, 0xFFFFFFFC, 0x00000000, 0x00000004,
+    0x00000040, 0x00000020, 0x00000010, 0x00000010, 0x0000002F, 0xFFFFFFF0, 0x00000020, 0x00000030,
+    0xFFFFFFF2, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFF3, 0x0000000C, 0xFFFFFFFF, 0xFFFFFFF3,
+    0x903F8622, 0xE8838B21, 0x49E60541, 0x7A9470F1, 0xC73CDE6B, 0xA6D4DEAE, 0x4348C18C, 0xAF037508,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000600, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00155555, 0x55555555, 0x55555555, 0x2AAAAAAA, 0xAAAAAAAA,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x0000052A, 0xAAAAAAAA, 0xAAAAAAAA,
+    0x55555555, 0x55555000, 0x00000555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555554,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x60000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x15555555, 0x55555555, 0x2AAAAAAA, 0xAAAAAAAA,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x50440924, 0xA8A88809,
+    0xAA952A24, 0xA4890142, 0xA08A4A55, 0x4AA01152, 0xAAAAAAAA, 0xAAAAAAAA, 0xAAAAAAAA, 0xAAAAAAAA,
+    0x4459E97D, 0x8704EC17, 0x5A87B666, 0xB0930F0C, 0xF9E607B9, 0x729B013F, 0x84CA2643, 0xD0600A7A,
+    0x8F359753, 0x075CD6F6, 0x3533EC19, 0xB8A923E3, 0x07D795E3, 0x34CA57EA, 0x04D53964, 0xF0B43775,
+    0x00000004, 0x00000000, 0x00000000, 0x00000000, 0x00000003, 0xFFFFFFFC, 0x00000000, 0x00000004,
+    0xFFFFFFF2, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFF3, 0x0000000C, 0xFFFFFFFF, 0xFFFFFFF3,
+    0xC09E1FE1, 0x4AA8A4FB, 0x34381262, 0xF203B2C1, 0x70407E79, 0x6437FECD, 0x2CCF8082, 0xEB60C348,
+    0x2C25A5C8, 0xF788C9E7, 0x700E80E2, 0x244EC4A3, 0x3D73AF83, 0xF83B8DDD, 0xFF5933B4, 0x883E3F21,
+    0x00000004, 0x00000000, 0x00000000, 0x00000000, 0x00000003, 0xFFFFFFFC, 0x00000000, 0x00000004,
+    0xFFFFFFF2, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFF3, 0x0000000C, 0xFFFFFFFF, 0xFFFFFFF3,
+    0x4471A7C5, 0x4CCA7D66, 0x5D96C92F, 0x533CCF43, 0xDF48A731, 0x187B7E95, 0xD3BA1388, 0xE6836771,
+    0xEC7A0511, 0x12D090E9, 0x18910872, 0x6609F928, 0xE91943C5, 0xE1FC3968, 0x04256EDE, 0x81EB8C59,
+    0x00000004, 0x00000000, 0x00000000, 0x00000000, 0x00000003, 0xFFFFFFFC, 0x00000000, 0x00000004,
+    0xFFFFFFF2, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFF3, 0x0000000C, 0xFFFFFFFF, 0xFFFFFFF3,
+    0x27994104, 0x5A2D3159, 0xA003DA59, 0x466D30D4, 0xAFDC4C3D, 0x45534DDA, 0xEE7D586A, 0x2A452D43,
+    0x8D5B3D1B, 0x30599D1C, 0x7FFE78F5, 0x0158B97D, 0xE0684BDC, 0x88473877, 0xC1C1B801, 0xB6628CC5,
+    0x00000004, 0x00000000, 0x00000000, 0x00000000, 0x00000003, 0xFFFFFFFC, 0x00000000, 0x00000004,
+    0xFFFFFFF2, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFF3, 0x0000000C, 0xFFFFFFFF, 0xFFFFFFF3,
+    0x7006BDA7, 0x8C0FBC93, 0xE82F5B00, 0x1FDF3AD4, 0xE0976032, 0x9BDD6C35, 0x5B1393CE, 0x25D46365,
+    0xBCD42201, 0x5A332E19, 0x464D8B1A, 0x54DCD086, 0x2FF9294D, 0x92373ABA, 0x75D73E79, 0xAFF2F249,
+    0x00000004, 0x00000000, 0x00000000, 0x00000000, 0x00000003, 0xFFFFFFFC, 0x00000000, 0x00000004,
+    0xFFFFFFF2, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFF3, 0x0000000C, 0xFFFFFFFF, 0xFFFFFFF3,
+    0x54910AD4, 0xFF79F940, 0x2D59190A, 0x1DC49448, 0x9527D593, 0xF5AEAE60, 0xECE64A90, 0x80AF78E7,
+    0xE8242565, 0x095C3079, 0xB6C3B762, 0x41B7B231, 0x6C653C2C, 0x20ECA6F5, 0x9B3BF422, 0x8F4F85B9,
+    0x00000004, 0x00000000, 0x00000000, 0x00000000, 0x00000003, 0xFFFFFFFC, 0x00000000, 0x00000004,
+    0xFFFFFFF2, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFF3, 0x0000000C, 0xFFFFFFFF, 0xFFFFFFF3,
+    0xC5DB0BE9, 0x0D2E255F, 0xCC849156, 0x8CE4163B, 0x82B475E7, 0x16B51C1E, 0xC95379BA, 0x017C3B63,
+    0x103AAF68, 0x6F39DEDB, 0x99816AA0, 0x36995785, 0xEBCDEAD9, 0xAA98A39F, 0xA90A9A4A, 0x458BFE12,
+    0x00000004, 0x00000000, 0x00000000, 0x00000000, 0x00000003, 0xFFFFFFFC, 0x00000000, 0x00000004,
+    0xFFFFFFF2, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFF3, 0x0000000C, 0xFFFFFFFF, 0xFFFFFFF3,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000001,
+    0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555,
+    0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555,
+    0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555,
+    0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555,
+    0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555,
+    0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555,
+    0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555, 0x55555555,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x80000000, 0x00000000, 0x00000000, 0x00000000,
+    0xffffffff, 0xffffffff, 0xfC000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x03ffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000001,
+    0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xfff00000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x000fffff, 0xffffffff,
+    0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff};
+
+/* ----------------------------------------------------------------
+ * Firmware images
+ *
+ * An image file is an SM2_image_header_t followed by the in_code,
+ * ex_code and SM2_Data sections. It is mapped read-only and uploaded
+ * straight from the mapping. The tables above are the built-in
+ * default image, used by any device without SM2_SetImage().
+ * ----------------------------------------------------------------
+ */
+static SM2_image_t default_image = {
+    SM2_IMAGE_VERSION, 0, SM2_in_code, SM2_ex_code, SM2_Data, NULL, 0};
+
+static U32 image_sections_crc(const U32 *in_code, const U32 *ex_code, const U32 *data)
+{
+    U32 crc = crc32_update(0, in_code, sizeof(U32) * SM2_IN_CODE_WORDS);
+    crc = crc32_update(crc, ex_code, sizeof(U32) * SM2_EX_CODE_WORDS);
+    return crc32_update(crc, data, sizeof(U32) * SM2_DATA_WORDS);
+}
+
+const SM2_image_t *SM2_ImageDefault(void)
+{
+    if (default_image.crc == 0)
+    {
+        default_image.crc = image_sections_crc(SM2_in_code, SM2_ex_code, SM2_Data);
+    }
+    return &default_image;
+}
+
+int SM2_ImageLoad(const char *path, SM2_image_t *img)
+{
+    /**
+     * @description: map an image file and check its header and CRC
+     * @param: 
+     *          path - image file
+     *          img - filled with pointers into the mapping
+     * @return: int
+     *          0 - success
+     *          -1 - unreadable, malformed or corrupt image
+     */
+    const SM2_image_header_t *hdr;
+    struct stat statbuf;
+    int fd;
+
+    memset(img, 0, sizeof(SM2_image_t));
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("Open failed for file '%s': errno %d, %s\n", path, errno, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &statbuf) < 0 || (size_t)statbuf.st_size < sizeof(SM2_image_header_t))
+    {
+        printf("Image '%s' is truncated\n", path);
+        close(fd);
+        return -1;
+    }
+    img->map_len = statbuf.st_size;
+    img->map = mmap(NULL, img->map_len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (img->map == MAP_FAILED)
+    {
+        printf("mmap() of '%s' failed: errno %d, %s\n", path, errno, strerror(errno));
+        img->map = NULL;
+        return -1;
+    }
+
+    hdr = (const SM2_image_header_t *)img->map;
+    if (hdr->magic != SM2_IMAGE_MAGIC || hdr->format != SM2_IMAGE_FORMAT)
+    {
+        printf("Image '%s' has a bad magic or format\n", path);
+        SM2_ImageUnload(img);
+        return -1;
+    }
+    const U32 words[3] = {SM2_IN_CODE_WORDS, SM2_EX_CODE_WORDS, SM2_DATA_WORDS};
+    for (int i = 0; i < 3; i++)
+    {
+        if (hdr->section[i].nwords != words[i] || hdr->section[i].offset % sizeof(U32) != 0 ||
+            hdr->section[i].offset + sizeof(U32) * words[i] > img->map_len)
+        {
+            printf("Image '%s' section %d is out of bounds\n", path, i);
+            SM2_ImageUnload(img);
+            return -1;
+        }
+    }
+    img->in_code = (const U32 *)((const U8 *)img->map + hdr->section[0].offset);
+    img->ex_code = (const U32 *)((const U8 *)img->map + hdr->section[1].offset);
+    img->data = (const U32 *)((const U8 *)img->map + hdr->section[2].offset);
+    img->version = hdr->version;
+    img->crc = image_sections_crc(img->in_code, img->ex_code, img->data);
+    if (img->crc != hdr->crc)
+    {
+        printf("Image '%s' CRC mismatch: %08x, header says %08x\n", path, img->crc, hdr->crc);
+        SM2_ImageUnload(img);
+        return -1;
+    }
+    return 0;
+}
+
+void SM2_ImageUnload(SM2_image_t *img)
+{
+    if (img->map != NULL)
+    {
+        munmap(img->map, img->map_len);
+    }
+    memset(img, 0, sizeof(SM2_image_t));
+}
+
+int SM2_ImageWrite(const char *path, const SM2_image_t *img)
+{
+    /**
+     * @description: write an image file, e.g. to export the built-in default
+     * @return: int
+     *          0 - success
+     *          -1 - write failed
+     */
+    SM2_image_header_t hdr;
+    FILE *fp;
+    int ok;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SM2_IMAGE_MAGIC;
+    hdr.format = SM2_IMAGE_FORMAT;
+    hdr.version = img->version;
+    hdr.crc = image_sections_crc(img->in_code, img->ex_code, img->data);
+    hdr.section[0].offset = sizeof(hdr);
+    hdr.section[0].nwords = SM2_IN_CODE_WORDS;
+    hdr.section[1].offset = hdr.section[0].offset + sizeof(U32) * SM2_IN_CODE_WORDS;
+    hdr.section[1].nwords = SM2_EX_CODE_WORDS;
+    hdr.section[2].offset = hdr.section[1].offset + sizeof(U32) * SM2_EX_CODE_WORDS;
+    hdr.section[2].nwords = SM2_DATA_WORDS;
+
+    fp = fopen(path, "wb");
+    if (fp == NULL)
+    {
+        printf("Open failed for file '%s': errno %d, %s\n", path, errno, strerror(errno));
+        return -1;
+    }
+    ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+         fwrite(img->in_code, sizeof(U32), SM2_IN_CODE_WORDS, fp) == SM2_IN_CODE_WORDS &&
+         fwrite(img->ex_code, sizeof(U32), SM2_EX_CODE_WORDS, fp) == SM2_EX_CODE_WORDS &&
+         fwrite(img->data, sizeof(U32), SM2_DATA_WORDS, fp) == SM2_DATA_WORDS;
+    if (fclose(fp) != 0 || !ok)
+    {
+        printf("Write failed for file '%s'\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+void SM2_SetImage(device_t *dev, const SM2_image_t *img)
+{
+    dev->image = img;
+}
+
+static const SM2_image_t *device_image(device_t *dev)
+{
+    return dev->image != NULL ? dev->image : SM2_ImageDefault();
+}
+
+static int engine_holds_image(device_t *dev, U32 base_addr)
+{
+    U32 param[SM2_EX_CODE_WORDS];
+
+    if (read_le32(dev, base_addr + STATE_ADDR * sizeof(U32)) & 1)
+    {
+        return 0;
+    }
+
+    // PARAM_ADDR is never touched by operations, so ex_code must still be there
+    for (int i = 0; i < SM2_EX_CODE_WORDS; i++)
+    {
+        param[i] = read_le32(dev, base_addr + (PARAM_ADDR + i) * sizeof(U32));
+    }
+    return memcmp(param, device_image(dev)->ex_code, sizeof(param)) == 0;
+}
+
+static int engine_is_warm(device_t *dev, U32 base_addr)
+{
+    return dev->shm != NULL && dev->shm->image_crc[ENGINE_INDEX(base_addr)] == device_image(dev)->crc &&
+           engine_holds_image(dev, base_addr);
+}
+
+static int init_warm_owned(device_t *dev, U32 base_addr)
+{
+    // caller holds the engine lock
+    if (engine_is_warm(dev, base_addr))
+    {
+        return 0;
+    }
+    return init_owned(dev, base_addr) == 0 ? 1 : SM2_TIMEDOUT;
+}
+
+int SM2_InitWarm(device_t *dev, U32 base_addr)
+{
+    /**
+     * @description: init HSM2 unless the engine already holds the image;
+     *               a process arriving while another one loads waits for it
+     * @param: 
+     *          dev - pcie device
+     * @return: int
+     *          0 - engine already initialised, reload skipped
+     *          1 - image loaded with SM2_Init()
+     *          SM2_TIMEDOUT - engine hung during the load
+     *          -1 - engine lock failed, the engine was not touched
+     */
+    int loaded;
+
+    if (device_lock_engine(dev, base_addr) < 0)
+    {
+        printf("Engine %d lock failed, not initialised\n", ENGINE_INDEX(base_addr));
+        return -1;
+    }
+    loaded = init_warm_owned(dev, base_addr);
+    device_unlock_engine(dev, base_addr);
+    return loaded;
+}
+
+int SM2_InitWarmOwned(device_t *dev, U32 base_addr)
+{
+    /**
+     * @description: as SM2_InitWarm(), for a caller that already holds
+     *               the engine through device_lock_engine()
+     * @return: int - as SM2_InitWarm()
+     */
+    return init_warm_owned(dev, base_addr);
+}
+
+static void init_stage1(device_t *dev, U32 base_addr)
+{
+    const SM2_image_t *img = device_image(dev);
+    U32 addr;
+
+    HSM2_PROBE1(init_start, base_addr);
+    TRACE_BEGIN(t);
+    // the engine holds no valid image until CMD_INIT2 completes, and the
+    // image overwrites the DATA window whoever uploaded to it last
+    if (dev->shm != NULL)
+    {
+        dev->shm->image_crc[ENGINE_INDEX(base_addr)] = 0;
+        dev->shm->data_owner[ENGINE_INDEX(base_addr)] = 0;
+    }
+    shadow_invalidate(dev, base_addr);
+
+    // Soft reset command
+    write_cmd(dev, base_addr, CMD_SOFTRST);
+
+    // SM2_in_code
+    addr = base_addr + DATA_ADDR * sizeof(U32);
+    write_block(dev, addr, img->in_code, SM2_IN_CODE_WORDS);
+    flush_block(dev, addr, sizeof(U32) * SM2_IN_CODE_WORDS);
+
+    // SM2_ex_code
+    addr = base_addr + PARAM_ADDR * sizeof(U32);
+    write_block(dev, addr, img->ex_code, SM2_EX_CODE_WORDS);
+    flush_block(dev, addr, sizeof(U32) * SM2_EX_CODE_WORDS);
+
+    // Init command 1
+    write_cmd(dev, base_addr, CMD_INIT1);
+    dev->init_issued_ns[ENGINE_INDEX(base_addr)] = now_ns();
+    TRACE_END(t, SM2_PHASE_INIT_CODE, 0);
+}
+
+static U32 init_wait(device_t *dev, U32 base_addr, U32 cmd)
+{
+    // init commands never become jobs, so they are counted here under SM2_OP_INIT
+    U32 d32 = wait_idle(dev, base_addr, cmd, 0, SM2_Deadline(dev->timeout_ns));
+
+    if (d32 & 1)
+    {
+        stats_timeout(dev, base_addr, cmd);
+    }
+    else
+    {
+        stats_complete(dev, base_addr, cmd, dev->init_issued_ns[ENGINE_INDEX(base_addr)], d32);
+    }
+    return d32;
+}
+
+static int init_stage2(device_t *dev, U32 base_addr)
+{
+    const SM2_image_t *img = device_image(dev);
+    U32 addr;
+
+    // Wait for EBUSY signal
+    if (init_wait(dev, base_addr, CMD_INIT1) & 1)
+    {
+        HSM2_PROBE2(init_done, base_addr, SM2_TIMEDOUT);
+        return SM2_TIMEDOUT;
+    }
+    TRACE_BEGIN(t);
+
+    // SM2_Data
+    addr = base_addr + DATA_ADDR * sizeof(U32);
+    write_block(dev, addr, img->data, SM2_DATA_WORDS);
+    flush_block(dev, addr, sizeof(U32) * SM2_DATA_WORDS);
+
+    // Init command 2
+    write_cmd(dev, base_addr, CMD_INIT2);
+    dev->init_issued_ns[ENGINE_INDEX(base_addr)] = now_ns();
+    TRACE_END(t, SM2_PHASE_INIT_DATA, 0);
+    return 0;
+}
+
+static int init_finish(device_t *dev, U32 base_addr)
+{
+    // Wait for EBUSY signal
+    if (init_wait(dev, base_addr, CMD_INIT2) & 1)
+    {
+        HSM2_PROBE2(init_done, base_addr, SM2_TIMEDOUT);
+        return SM2_TIMEDOUT;
+    }
+    if (dev->shm != NULL)
+    {
+        dev->shm->image_crc[ENGINE_INDEX(base_addr)] = device_image(dev)->crc;
+    }
+    HSM2_PROBE2(init_done, base_addr, 0);
+    return 0;
+}
+
+int SM2_Init(device_t *dev, U32 base_addr)
+{
+    /**
+     * @description: init HSM2
+     * @param: 
+     *          dev - pcie device
+     * @return: int
+     *          0 - success
+     *          SM2_TIMEDOUT - engine did not finish CMD_INIT1 or CMD_INIT2
+     *          -1 - engine lock failed, the engine was not touched
+     */
+    int status;
+
+    // the soft reset would cut off a command another process has in flight
+    if (device_lock_engine(dev, base_addr) < 0)
+    {
+        printf("Engine %d lock failed, not initialised\n", ENGINE_INDEX(base_addr));
+        return -1;
+    }
+    status = init_owned(dev, base_addr);
+    device_unlock_engine(dev, base_addr);
+    return status;
+}
+
+static int init_owned(device_t *dev, U32 base_addr)
+{
+    // caller holds the engine lock
+    init_stage1(dev, base_addr);
+    if (init_stage2(dev, base_addr) != 0 || init_finish(dev, base_addr) != 0)
+    {
+        printf("Initialization of engine %d timed out\n", ENGINE_INDEX(base_addr));
+        return SM2_TIMEDOUT;
+    }
+    printf("Initialization finished!\n");
+    return 0;
+}
+
+int SM2_InitEngines(engine_t *engines, int n)
+{
+    /**
+     * @description: init several engines with their init sequences overlapped
+     * @param: 
+     *          engines - engines to bring up, ready is set on return
+     *          n - number of engines
+     * @return: int
+     *          number of engines that needed a full image load
+     */
+    char *cold = (char *)calloc(n, 1);
+    int loaded = 0;
+
+    // CMD_INIT1 goes out to every cold engine before any of them is waited on.
+    // Engines another process holds are left for later rather than waited on
+    // here, so two processes initialising the same cards cannot deadlock.
+    for (int i = 0; i < n; i++)
+    {
+        engine_t *e = &engines[i];
+        e->ready = 0;
+        if (device_trylock_engine(e->dev, e->base_addr) < 0)
+        {
+            continue;
+        }
+        if (engine_is_warm(e->dev, e->base_addr))
+        {
+            device_unlock_engine(e->dev, e->base_addr);
+            e->ready = 1;
+            continue;
+        }
+        init_stage1(e->dev, e->base_addr);
+        cold[i] = 1;
+        loaded++;
+    }
+
+    // each SM2_Data upload overlaps with the other engines still computing
+    for (int i = 0; i < n; i++)
+    {
+        if (cold[i] && init_stage2(engines[i].dev, engines[i].base_addr) != 0)
+        {
+            cold[i] = 2;
+        }
+    }
+    for (int i = 0; i < n; i++)
+    {
+        if (cold[i])
+        {
+            // an engine that hung stays not ready; the pool retries it on first use
+            engines[i].ready = cold[i] == 1 && init_finish(engines[i].dev, engines[i].base_addr) == 0;
+            device_unlock_engine(engines[i].dev, engines[i].base_addr);
+        }
+    }
+
+    // by now the other process has usually finished loading these
+    for (int i = 0; i < n; i++)
+    {
+        if (!engines[i].ready && !cold[i])
+        {
+            int status = SM2_InitWarm(engines[i].dev, engines[i].base_addr);
+            engines[i].ready = status >= 0;
+            loaded += status == 1;
+        }
+    }
+    free(cold);
+    printf("Initialization finished! %d of %d engines loaded\n", loaded, n);
+    return loaded;
+}
+
+int SM2_GenKey(device_t *dev, U32 base_addr, U32 *rand, U32 *pri_key, U32 *pub_key)
+{
+    /**
+     * @description: generate key pair
+     * @param: 
+     *          dev - pcie device
+     *          rand - random number sequence, 32 * 8
+     *          pri_key - private key, 32 * 8
+     *          pub_key - public key, 32 * 16 
+     * @return: int
+     *          0 - success
+     *          1 - random number false 
+     */
+
+    SM2_job_t job;
+    SM2_GenKeySubmit(dev, base_addr, &job, rand, pri_key, pub_key);
+    return SM2_Wait(&job);
+}
+
+int SM2_Sign(device_t *dev, U32 base_addr, U32 *rand, U32 *pri_key, U32 *hash, U32 *sign)
+{
+    /**
+     * @description: signature
+     * @param: 
+     *          dev - pcie device
+     *          rand - random number sequence, 32 * 8
+     *          pri_key - private key, 32 * 8
+     *          hash - hash value, 32 * 8
+     *          sign - sign result(r, s), 32 * 16 
+     * @return: int
+     *          0 - success
+     *          1 - random number false or
+     *              r = 0 mod n or
      *              r + k = 0 mod n
      */
-    U32 addr, d32;
-    // write rand, pri_key, hash
-    addr = base_addr + DATA_ADDR * sizeof(U32);
-    memcpy(dev->addr + addr, rand, sizeof(U32) * 8);                      // random number sequence
-    memcpy(dev->addr + addr + sizeof(U32) * 8, pri_key, sizeof(U32) * 8); // private key
-    memcpy(dev->addr + addr + sizeof(U32) * 16, hash, sizeof(U32) * 8);   // hash
-    msync((void *)(dev->addr + addr), sizeof(U32) * 24, MS_SYNC | MS_INVALIDATE);
+    SM2_job_t job;
+    SM2_SignSubmit(dev, base_addr, &job, rand, pri_key, hash, sign);
+    return SM2_Wait(&job);
+}
+
+int SM2_Verify(device_t *dev, U32 base_addr, U32 *pub_key, U32 *hash, U32 *sign)
+{
+    SM2_job_t job;
+    SM2_VerifySubmit(dev, base_addr, &job, pub_key, hash, sign);
+    return SM2_Wait(&job);
+}
+
+int SM2_Encrypt(device_t *dev, U32 base_addr, U32 *rand, U32 *pub_key, U32 *C1, U32 *S)
+{
+    SM2_job_t job;
+    SM2_EncryptSubmit(dev, base_addr, &job, rand, pub_key, C1, S);
+    return SM2_Wait(&job);
+}
+
+int SM2_Decrypt(device_t *dev, U32 base_addr, U32 *pri_key, U32 *C1, U32 *S)
+{
+    SM2_job_t job;
+    SM2_DecryptSubmit(dev, base_addr, &job, pri_key, C1, S);
+    return SM2_Wait(&job);
+}
+
+int SM2_KeyExchange(device_t *dev, U32 base_addr, U32 *self_r, U32 *self_Rx, U32 *self_d,
+                    U32 *other_R, U32 *other_P, U32 *UV)
+{
+    SM2_job_t job;
+    SM2_KeyExchangeSubmit(dev, base_addr, &job, self_r, self_Rx, self_d, other_R, other_P, UV);
+    return SM2_Wait(&job);
+}
+
+/* ----------------------------------------------------------------
+ * DATA window shadow
+ *
+ * Each device keeps a host copy of the input words it last wrote to
+ * every engine's DATA window. upload() only writes the runs of words
+ * that differ from that copy, so a key that is used again on the same
+ * engine is not sent twice. Words the engine overwrites with results
+ * are dropped from the copy when the command is issued, and the
+ * whole copy is dropped on init, after a timeout, when a dead owner's
+ * lock is recovered, and when another process has used the engine.
+ * The shadow is off until device_set_shadow() turns it on.
+ * ----------------------------------------------------------------
+ */
+void device_set_shadow(device_t *dev, int enable)
+{
+    /**
+     * @description: turn delta uploads on or off; they are off by
+     *               default and must stay off for firmware that uses
+     *               DATA words other than its outputs as scratch space
+     */
+    static U32 serial;
+
+    if (dev->token == 0)
+    {
+        dev->token = ((U64)getpid() << 32) | __atomic_add_fetch(&serial, 1, __ATOMIC_RELAXED);
+    }
+    dev->use_shadow = enable;
+    for (int i = 0; i < 2; i++)
+    {
+        memset(&dev->shadow[i], 0, sizeof(SM2_shadow_t));
+        dev->shadow[i].dirty_lo = SM2_SHADOW_WORDS;
+    }
+}
+
+static void shadow_invalidate(device_t *dev, U32 base_addr)
+{
+    SM2_shadow_t *shadow = &dev->shadow[ENGINE_INDEX(base_addr)];
+    memset(shadow->valid, 0, sizeof(shadow->valid));
+}
+
+static void upload(device_t *dev, U32 base_addr, U32 offset, const U32 *src, U32 nwords)
+{
+    SM2_shadow_t *shadow = &dev->shadow[ENGINE_INDEX(base_addr)];
+    U32 addr = base_addr + DATA_ADDR * sizeof(U32);
+    U32 *held = shadow->words + offset;
+    U8 *valid = shadow->valid + offset;
+#ifdef HSM2_TRACE
+    U64 sent = shadow->uploaded;
+#endif
+
+    TRACE_BEGIN(t);
+    for (U32 i = 0, j; i < nwords; i = j)
+    {
+        if (dev->use_shadow && valid[i] && held[i] == src[i])
+        {
+            shadow->skipped++;
+            j = i + 1;
+            continue;
+        }
+
+        // extend the run up to the next word the engine already holds
+        for (j = i; j < nwords && !(dev->use_shadow && valid[j] && held[j] == src[j]); j++)
+        {
+            held[j] = src[j];
+            valid[j] = 1;
+        }
+        write_block(dev, addr + sizeof(U32) * (offset + i), src + i, j - i);
+        shadow->uploaded += j - i;
+        if (offset + i < shadow->dirty_lo)
+        {
+            shadow->dirty_lo = offset + i;
+        }
+        if (offset + j > shadow->dirty_hi)
+        {
+            shadow->dirty_hi = offset + j;
+        }
+    }
+    TRACE_END(t, SM2_PHASE_UPLOAD, (U32)(shadow->uploaded - sent));
+}
+
+static void upload_flush(device_t *dev, U32 base_addr)
+{
+    SM2_shadow_t *shadow = &dev->shadow[ENGINE_INDEX(base_addr)];
+
+    if (shadow->dirty_hi > shadow->dirty_lo)
+    {
+        // whole 32-byte lines, as the WC backend streams them
+        U32 lo = shadow->dirty_lo & ~7u;
+        U32 hi = (shadow->dirty_hi + 7) & ~7u;
+        TRACE_BEGIN(t);
+        flush_block(dev, base_addr + (DATA_ADDR + lo) * sizeof(U32), sizeof(U32) * (hi - lo));
+        TRACE_END(t, SM2_PHASE_FLUSH, sizeof(U32) * (hi - lo));
+    }
+    shadow->dirty_lo = SM2_SHADOW_WORDS;
+    shadow->dirty_hi = 0;
+}
+
+/* ----------------------------------------------------------------
+ * Asynchronous submit/poll
+ *
+ * The *Submit calls upload the inputs, write CMD_ADDR and return
+ * straight away. The engine is owned by the job until SM2_Poll()
+ * or SM2_Wait() has reported completion and copied the results
+ * out of the DATA window. Only the words a command produces are
+ * read back, adjacent outputs in one run of loads; Verify reports
+ * through STATE alone and reads no data.
+ * ----------------------------------------------------------------
+ */
+static void job_start(SM2_job_t *job, device_t *dev, U32 base_addr, U32 cmd)
+{
+    U64 *owner = dev->shm != NULL ? &dev->shm->data_owner[ENGINE_INDEX(base_addr)] : NULL;
+
+    HSM2_PROBE3(submit, cmd, base_addr, job);
+    // another process wrote to this DATA window since we last did
+    if (owner != NULL && *owner != dev->token)
+    {
+        shadow_invalidate(dev, base_addr);
+        *owner = dev->token;
+    }
+
+    job->dev = dev;
+    job->base_addr = base_addr;
+    job->cmd = cmd;
+    job->status = SM2_PENDING;
+    job->nout = 0;
+    job->issued_ns = 0;
+}
+
+static void job_issue(SM2_job_t *job)
+{
+    SM2_shadow_t *shadow = &job->dev->shadow[ENGINE_INDEX(job->base_addr)];
+
+    // the engine overwrites these words with its results
+    for (int i = 0; i < job->nout; i++)
+    {
+        memset(shadow->valid + job->out_off[i], 0, job->out_len[i]);
+    }
+    TRACE_BEGIN(t);
+    write_cmd(job->dev, job->base_addr, job->cmd);
+    TRACE_END(t, SM2_PHASE_ISSUE, job->cmd);
+    job->issued_ns = now_ns();
+}
+
+static void job_output(SM2_job_t *job, U32 offset, U32 nwords, U32 *dst)
+{
+    job->out_off[job->nout] = offset;
+    job->out_len[job->nout] = nwords;
+    job->out[job->nout] = dst;
+    job->nout++;
+}
+
+static void job_complete(SM2_job_t *job, U32 d32)
+{
+    device_t *dev = job->dev;
+    U32 addr = job->base_addr + DATA_ADDR * sizeof(U32);
+    U32 buf[64] __attribute__((aligned(32)));
+    U32 loads = 1; // the STATE read that saw completion
+    U64 start = dev->readback_stats ? now_ns() : 0;
+
+    HSM2_PROBE4(complete, job->cmd, job->base_addr, d32 & 2, job);
+    stats_complete(dev, job->base_addr, job->cmd, job->issued_ns, d32);
+    TRACE_BEGIN(t);
+    for (int i = 0, j; i < job->nout; i = j)
+    {
+        U32 len = job->out_len[i];
+
+        // outputs that sit back to back are fetched as one range
+        for (j = i + 1; j < job->nout && job->out_off[j] == job->out_off[i] + len &&
+                        len + job->out_len[j] <= 64;
+             j++)
+        {
+            len += job->out_len[j];
+        }
+        if (j == i + 1)
+        {
+            loads += read_block(dev, addr + sizeof(U32) * job->out_off[i], job->out[i], len);
+            continue;
+        }
+        loads += read_block(dev, addr + sizeof(U32) * job->out_off[i], buf, len);
+        for (int k = i; k < j; k++)
+        {
+            memcpy(job->out[k], buf + (job->out_off[k] - job->out_off[i]), sizeof(U32) * job->out_len[k]);
+        }
+    }
+    job->status = d32 & 2;
+    TRACE_END(t, SM2_PHASE_READBACK, loads);
+    HSM2_PROBE4(readback, job->cmd, job->base_addr, loads, job);
+
+    // both engines of the card retire jobs concurrently
+    if (dev->readback_stats)
+    {
+        __atomic_fetch_add(&dev->readback_count, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&dev->readback_loads, loads, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&dev->readback_ns, now_ns() - start, __ATOMIC_RELAXED);
+    }
+}
+
+int SM2_GenKeySubmit(device_t *dev, U32 base_addr, SM2_job_t *job, U32 *rand, U32 *pri_key, U32 *pub_key)
+{
+    job_start(job, dev, base_addr, CMD_GENKEY);
+    job_output(job, 0, 8, pri_key);  // private key
+    job_output(job, 8, 16, pub_key); // public key
+
+    // write random number sequence
+    upload(dev, base_addr, 0, rand, 8);
+    upload_flush(dev, base_addr);
+
+    // write start command
+    job_issue(job);
+    return 0;
+}
+
+int SM2_SignSubmit(device_t *dev, U32 base_addr, SM2_job_t *job, U32 *rand, U32 *pri_key, U32 *hash, U32 *sign)
+{
+    job_start(job, dev, base_addr, CMD_SIGN);
+    job_output(job, 24, 16, sign); // sign result
+
+    // write rand, pri_key, hash
+    upload(dev, base_addr, 0, rand, 8);    // random number sequence
+    upload(dev, base_addr, 8, pri_key, 8); // private key
+    upload(dev, base_addr, 16, hash, 8);   // hash
+    upload_flush(dev, base_addr);
+
+    // write start command
+    job_issue(job);
+    return 0;
+}
+
+int SM2_VerifySubmit(device_t *dev, U32 base_addr, SM2_job_t *job, U32 *pub_key, U32 *hash, U32 *sign)
+{
+    job_start(job, dev, base_addr, CMD_VERIFY);
+
+    // write pub_key, hash, sign
+    upload(dev, base_addr, 0, pub_key, 16); // public key
+    upload(dev, base_addr, 16, hash, 8);    // hash value
+    upload(dev, base_addr, 24, sign, 16);   // signature result
+    upload_flush(dev, base_addr);
+
+    // write start command
+    job_issue(job);
+    return 0;
+}
+
+int SM2_EncryptSubmit(device_t *dev, U32 base_addr, SM2_job_t *job, U32 *rand, U32 *pub_key, U32 *C1, U32 *S)
+{
+    job_start(job, dev, base_addr, CMD_ENCRYPT);
+    job_output(job, 24, 16, C1);
+    job_output(job, 40, 16, S);
+
+    // write rand, pub_key
+    upload(dev, base_addr, 0, rand, 8);     // random number sequence
+    upload(dev, base_addr, 8, pub_key, 16); // public key
+    upload_flush(dev, base_addr);
+
+    // write start command
+    job_issue(job);
+    return 0;
+}
+
+int SM2_DecryptSubmit(device_t *dev, U32 base_addr, SM2_job_t *job, U32 *pri_key, U32 *C1, U32 *S)
+{
+    job_start(job, dev, base_addr, CMD_DECRYPT);
+    job_output(job, 24, 16, S);
+
+    // write pri_key, C1
+    upload(dev, base_addr, 0, pri_key, 8); // private key
+    upload(dev, base_addr, 8, C1, 16);     // C1
+    upload_flush(dev, base_addr);
+
+    // write start command
+    job_issue(job);
+    return 0;
+}
+
+int SM2_KeyExchangeSubmit(device_t *dev, U32 base_addr, SM2_job_t *job, U32 *self_r, U32 *self_Rx, U32 *self_d,
+                          U32 *other_R, U32 *other_P, U32 *UV)
+{
+    job_start(job, dev, base_addr, CMD_KEYX);
+    job_output(job, 56, 16, UV);
+
+    // write self_r, self_Rx, self_d, other_R, other_P
+    upload(dev, base_addr, 0, self_r, 8);
+    upload(dev, base_addr, 8, self_Rx, 8);
+    upload(dev, base_addr, 16, self_d, 8);
+    upload(dev, base_addr, 24, other_R, 16);
+    upload(dev, base_addr, 40, other_P, 16);
+    upload_flush(dev, base_addr);
+
+    // write start command
+    job_issue(job);
+    return 0;
+}
+
+int SM2_SignVerify(device_t *dev, U32 base_addr, U32 *rand, U32 *pri_key, U32 *pub_key, U32 *hash, U32 *sign)
+{
+    /**
+     * @description: sign, then have the same engine verify the signature
+     *               it just produced, to catch faulted signatures
+     * @param: 
+     *          rand, pri_key, hash - as SM2_Sign
+     *          pub_key - public key of pri_key
+     *          sign - sign result(r, s), only written once it verified;
+     *                 zeroed on any other outcome
+     * @return: int
+     *          0 - signature produced and verified
+     *          SM2_BADSIG - the engine rejected its own signature
+     *          otherwise as SM2_Sign
+     */
+    SM2_job_t job;
+    U32 out[16];
+    int check;
+
+    SM2_SignSubmit(dev, base_addr, &job, rand, pri_key, hash, out);
+    check = SM2_Wait(&job);
+    if (check != 0)
+    {
+        memset(sign, 0, sizeof(out));
+        return check;
+    }
+
+    // the hash is still at +16 and the signature at +24, where
+    // CMD_VERIFY reads them, so only the public key goes up
+    job_start(&job, dev, base_addr, CMD_VERIFY);
+    upload(dev, base_addr, 0, pub_key, 16);
+    upload_flush(dev, base_addr);
+    job_issue(&job);
+    check = SM2_Wait(&job);
+    if (check != 0)
+    {
+        // a faulted signature must not reach the caller
+        memset(sign, 0, sizeof(out));
+        if (check == SM2_TIMEDOUT)
+        {
+            return check;
+        }
+        printf("Signature failed verification on engine %d\n", ENGINE_INDEX(base_addr));
+        return SM2_BADSIG;
+    }
+    memcpy(sign, out, sizeof(out));
+    return 0;
+}
+
+int SM2_Poll(SM2_job_t *job)
+{
+    /**
+     * @description: check a submitted job once, without blocking
+     * @param: 
+     *          job - job filled in by one of the *Submit calls
+     * @return: int
+     *          SM2_PENDING - engine still busy
+     *          otherwise the check bit of the operation, as returned
+     *          by the synchronous call
+     */
+    if (job->status != SM2_PENDING)
+    {
+        return job->status;
+    }
+
+    U32 d32 = read_le32(job->dev, job->base_addr + STATE_ADDR * sizeof(U32));
+    if (d32 & 1)
+    {
+        stats_polls(job->dev, job->base_addr, job->cmd, 1);
+        return SM2_PENDING;
+    }
+    job_complete(job, d32);
+    return job->status;
+}
+
+int SM2_Wait(SM2_job_t *job)
+{
+    /**
+     * @description: wait for a job, bounded by the device timeout
+     * @return: int
+     *          SM2_TIMEDOUT - engine still busy after timeout_ns
+     *          otherwise as SM2_Poll()
+     */
+    U64 timeout_ns = job->dev->timeout_ns;
+    return SM2_WaitDeadline(job, timeout_ns != 0 ? job->issued_ns + timeout_ns : 0);
+}
+
+int SM2_WaitDeadline(SM2_job_t *job, U64 deadline_ns)
+{
+    /**
+     * @description: wait for a job until an absolute deadline
+     * @param: 
+     *          deadline_ns - CLOCK_MONOTONIC time in ns, see SM2_Deadline();
+     *                        0 waits forever
+     * @return: int
+     *          SM2_TIMEDOUT - engine still busy at the deadline, the job
+     *                         stays pending
+     *          otherwise as SM2_Poll()
+     */
+    U32 d32;
+
+    if (job->status != SM2_PENDING)
+    {
+        return job->status;
+    }
+
+    // Wait for EBUSY signal
+    d32 = wait_idle(job->dev, job->base_addr, job->cmd, job->issued_ns, deadline_ns);
+    if (d32 & 1)
+    {
+        // a hung engine may have left anything in its DATA window
+        shadow_invalidate(job->dev, job->base_addr);
+        stats_timeout(job->dev, job->base_addr, job->cmd);
+        HSM2_PROBE3(timeout, job->cmd, job->base_addr, job);
+        return SM2_TIMEDOUT;
+    }
+    job_complete(job, d32);
+    return job->status;
+}
+
+U64 SM2_Deadline(U64 timeout_ns)
+{
+    return now_ns() + timeout_ns;
+}
+
+void device_set_timeout(device_t *dev, U64 timeout_ns)
+{
+    dev->timeout_ns = timeout_ns;
+}
+
+int SM2_Recover(device_t *dev, U32 base_addr)
+{
+    /**
+     * @description: soft-reset a hung engine and reload its image;
+     *               the caller must own the engine
+     * @return: int
+     *          0 - engine is back in service
+     *          SM2_TIMEDOUT - engine did not come back
+     */
+    printf("Recovering engine %d of %04x:%02x:%02x.%1x\n", ENGINE_INDEX(base_addr),
+           dev->domain, dev->bus, dev->slot, dev->function);
+    return init_owned(dev, base_addr);
+}
+
+/* ----------------------------------------------------------------
+ * Zero-copy submission
+ *
+ * SM2_Reserve() hands out the engine's DATA window (the WC staging
+ * buffer under SM2_BACKEND_WC) so the caller can build the inputs in
+ * place, field by field through SM2_SlotField(). SM2_Commit() then
+ * pushes the window out and writes CMD_ADDR, returning a job like the
+ * *Submit calls. Outside the WC backend the window is uncached device
+ * memory: fill it with plain 32- or 64-bit stores and never read it.
+ * ----------------------------------------------------------------
+ */
+typedef struct
+{
+    U32 cmd;
+    int field;
+    U32 offset;
+    U32 nwords;
+} field_layout_t;
+
+// inputs of every command, and outputs in SM2_Commit() argument order
+static const field_layout_t input_layout[] = {
+    {CMD_GENKEY, SM2_FIELD_RAND, 0, 8},
+    {CMD_SIGN, SM2_FIELD_RAND, 0, 8},
+    {CMD_SIGN, SM2_FIELD_PRI_KEY, 8, 8},
+    {CMD_SIGN, SM2_FIELD_HASH, 16, 8},
+    {CMD_VERIFY, SM2_FIELD_PUB_KEY, 0, 16},
+    {CMD_VERIFY, SM2_FIELD_HASH, 16, 8},
+    {CMD_VERIFY, SM2_FIELD_SIGN, 24, 16},
+    {CMD_ENCRYPT, SM2_FIELD_RAND, 0, 8},
+    {CMD_ENCRYPT, SM2_FIELD_PUB_KEY, 8, 16},
+    {CMD_DECRYPT, SM2_FIELD_PRI_KEY, 0, 8},
+    {CMD_DECRYPT, SM2_FIELD_C1, 8, 16},
+    {CMD_KEYX, SM2_FIELD_SELF_R, 0, 8},
+    {CMD_KEYX, SM2_FIELD_SELF_RX, 8, 8},
+    {CMD_KEYX, SM2_FIELD_SELF_D, 16, 8},
+    {CMD_KEYX, SM2_FIELD_OTHER_R, 24, 16},
+    {CMD_KEYX, SM2_FIELD_OTHER_P, 40, 16},
+};
+
+static const field_layout_t output_layout[] = {
+    {CMD_GENKEY, -1, 0, 8},    // pri_key
+    {CMD_GENKEY, -1, 8, 16},   // pub_key
+    {CMD_SIGN, -1, 24, 16},    // sign
+    {CMD_ENCRYPT, -1, 24, 16}, // C1
+    {CMD_ENCRYPT, -1, 40, 16}, // S
+    {CMD_DECRYPT, -1, 24, 16}, // S
+    {CMD_KEYX, -1, 56, 16},    // UV
+};
+
+#define LAYOUT_LEN(t) ((int)(sizeof(t) / sizeof((t)[0])))
+
+int SM2_Reserve(device_t *dev, U32 base_addr, U32 cmd, SM2_slot_t *slot)
+{
+    /**
+     * @description: open the input window of an engine for one command
+     * @param: 
+     *          cmd - CMD_GENKEY ... CMD_KEYX
+     *          slot - returned view, valid until SM2_Commit()
+     * @return: int
+     *          0 - success
+     *          -1 - cmd takes no inputs through the DATA window
+     */
+    U32 addr = base_addr + DATA_ADDR * sizeof(U32);
+
+    slot->nwords = 0;
+    for (int i = 0; i < LAYOUT_LEN(input_layout); i++)
+    {
+        if (input_layout[i].cmd == cmd && input_layout[i].offset + input_layout[i].nwords > slot->nwords)
+        {
+            slot->nwords = input_layout[i].offset + input_layout[i].nwords;
+        }
+    }
+    if (slot->nwords == 0)
+    {
+        printf("Command 0x%08x cannot be reserved\n", cmd);
+        return -1;
+    }
+
+    slot->dev = dev;
+    slot->base_addr = base_addr;
+    slot->cmd = cmd;
+    slot->window = (U32 *)(dev->backend == SM2_BACKEND_WC ? dev->staging + addr : dev->addr + addr);
+    return 0;
+}
+
+U32 *SM2_SlotField(const SM2_slot_t *slot, int field, U32 nwords)
+{
+    /**
+     * @description: typed view of one input of a reserved command
+     * @param: 
+     *          field - SM2_FIELD_*
+     *          nwords - size the caller will write, checked against the layout
+     * @return: U32 * - where to write the field, NULL if the command has
+     *          no such input or it is not nwords long
+     */
+    for (int i = 0; i < LAYOUT_LEN(input_layout); i++)
+    {
+        const field_layout_t *f = &input_layout[i];
+        if (f->cmd == slot->cmd && f->field == field)
+        {
+            return f->nwords == nwords ? slot->window + f->offset : NULL;
+        }
+    }
+    return NULL;
+}
+
+int SM2_Commit(SM2_slot_t *slot, SM2_job_t *job, U32 *out0, U32 *out1)
+{
+    /**
+     * @description: start a reserved command once its inputs are in place
+     * @param: 
+     *          job - returned job, complete it with SM2_Poll()/SM2_Wait()
+     *          out0, out1 - result buffers in the order the synchronous
+     *                       call returns them (pri_key, pub_key for
+     *                       GenKey; C1, S for Encrypt); NULL if unused
+     * @return: int
+     *          0 - command issued
+     *          -1 - a result buffer is missing
+     */
+    device_t *dev = slot->dev;
+    SM2_shadow_t *shadow = &dev->shadow[ENGINE_INDEX(slot->base_addr)];
+    U32 *outs[2] = {out0, out1};
+    int nout = 0;
+
+    job_start(job, dev, slot->base_addr, slot->cmd);
+    for (int i = 0; i < LAYOUT_LEN(output_layout); i++)
+    {
+        if (output_layout[i].cmd != slot->cmd)
+        {
+            continue;
+        }
+        if (outs[nout] == NULL)
+        {
+            printf("Missing result buffer %d for command 0x%08x\n", nout, slot->cmd);
+            return -1;
+        }
+        job_output(job, output_layout[i].offset, output_layout[i].nwords, outs[nout++]);
+    }
+
+    // the caller wrote these words behind the shadow's back
+    memset(shadow->valid, 0, slot->nwords);
+    TRACE_BEGIN(t);
+    flush_block(dev, slot->base_addr + DATA_ADDR * sizeof(U32), sizeof(U32) * slot->nwords);
+    TRACE_END(t, SM2_PHASE_FLUSH, sizeof(U32) * slot->nwords);
+    job_issue(job);
+    return 0;
+}
+
+/* ----------------------------------------------------------------
+ * Completion waiting
+ *
+ * STATE is polled in three stages: a short spin with PAUSE between
+ * reads, then polls spaced by an exponentially growing number of
+ * PAUSEs, then nanosleep() between polls. On a device with an
+ * interrupt eventfd the waiter sleeps in poll() instead. With
+ * prediction enabled, the learned latency of the opcode is slept off
+ * first and only the tail is spun, so a waiting thread uses almost
+ * no CPU. Every wait is bounded by a deadline; an engine that is
+ * still busy when it passes is reported as SM2_TIMEDOUT.
+ * ----------------------------------------------------------------
+ */
+static U64 now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (U64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static void sleep_ns(U64 ns)
+{
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000ULL;
+    ts.tv_nsec = ns % 1000000000ULL;
+    nanosleep(&ts, NULL);
+}
+
+static int op_index(U32 cmd)
+{
+    switch (cmd)
+    {
+    case CMD_GENKEY:
+        return SM2_OP_GENKEY;
+    case CMD_SIGN:
+        return SM2_OP_SIGN;
+    case CMD_VERIFY:
+        return SM2_OP_VERIFY;
+    case CMD_ENCRYPT:
+        return SM2_OP_ENCRYPT;
+    case CMD_DECRYPT:
+        return SM2_OP_DECRYPT;
+    case CMD_KEYX:
+        return SM2_OP_KEYX;
+    default:
+        return SM2_OP_INIT;
+    }
+}
+
+void SM2_WaitPolicyDefault(SM2_wait_policy_t *policy)
+{
+    policy->spin_polls = 1000;
+    policy->backoff_polls = 16;
+    policy->sleep_ns = 20000;
+    policy->predict = 1;
+    policy->use_irq = 0;
+}
+
+void device_set_wait_policy(device_t *dev, const SM2_wait_policy_t *policy)
+{
+    dev->wait = *policy;
+}
+
+static U32 wait_idle(device_t *dev, U32 base_addr, U32 cmd, U64 issued_ns, U64 deadline_ns)
+{
+    /**
+     * @description: wait for the engine to drop its busy bit
+     * @param: 
+     *          cmd - command being waited on, selects the learned latency
+     *          issued_ns - now_ns() at the command write, 0 if unknown
+     *          deadline_ns - give up at this now_ns() time, 0 for never
+     * @return: U32 - final STATE word, busy bit still set on timeout
+     */
+    const SM2_wait_policy_t *policy = &dev->wait;
+    U32 addr, d32, polls = 0, pauses = 1;
+    int op = op_index(cmd), slept = 0;
+
+    // shared by both engines and every thread: a lost update only skips one sample
+    U64 latency = __atomic_load_n(&dev->latency_ns[op], __ATOMIC_RELAXED);
+    // irq_probe() may switch this on from another thread
+    int use_irq = __atomic_load_n(&policy->use_irq, __ATOMIC_RELAXED);
+
+    TRACE_BEGIN(t);
+    if (policy->predict && issued_ns != 0 && latency != 0)
+    {
+        // wake up a little before the expected completion
+        U64 due = issued_ns + latency - latency / 8;
+        U64 now = now_ns();
+        if (deadline_ns != 0 && due > deadline_ns)
+        {
+            due = deadline_ns;
+        }
+        if (due > now)
+        {
+            sleep_ns(due - now);
+            slept = 1;
+        }
+    }
+
+    addr = base_addr + STATE_ADDR * sizeof(U32);
+    d32 = read_le32(dev, addr);
+    while (d32 & 1)
+    {
+        if (deadline_ns != 0 && now_ns() >= deadline_ns)
+        {
+            break;
+        }
+        polls++;
+        if (use_irq && dev->irq_fd >= 0)
+        {
+            wait_irq(dev, base_addr);
+        }
+        else if (polls <= policy->spin_polls)
+        {
+            cpu_relax();
+        }
+        else if (polls <= policy->spin_polls + policy->backoff_polls)
+        {
+            for (U32 i = 0; i < pauses; i++)
+            {
+                cpu_relax();
+            }
+            // past ~64 PAUSEs the sleep stage is the cheaper wait
+            if (pauses < 64)
+            {
+                pauses *= 2;
+            }
+        }
+        else
+        {
+            sleep_ns(policy->sleep_ns);
+        }
+        d32 = read_le32(dev, addr);
+    }
+
+    TRACE_END(t, SM2_PHASE_WAIT, polls);
+    stats_polls(dev, base_addr, cmd, polls);
+    if (d32 & 1)
+    {
+        // timed out, nothing to learn
+        return d32;
+    }
+    if (!use_irq)
+    {
+        irq_probe(dev, base_addr);
+    }
+    if (issued_ns != 0 && polls > 0)
+    {
+        // completion was observed while polling: moving average over ~8 samples
+        U64 elapsed = now_ns() - issued_ns;
+        if (latency == 0)
+        {
+            latency = elapsed;
+        }
+        else
+        {
+            latency += ((long long)elapsed - (long long)latency) / 8;
+        }
+        __atomic_store_n(&dev->latency_ns[op], latency, __ATOMIC_RELAXED);
+    }
+    else if (slept)
+    {
+        // already done when the prediction woke us: the estimate is too long
+        __atomic_store_n(&dev->latency_ns[op], latency - latency / 16, __ATOMIC_RELAXED);
+    }
+    return d32;
+}
+
+/* ----------------------------------------------------------------
+ * Phase tracing
+ *
+ * Built only with -DHSM2_TRACE; otherwise TRACE_BEGIN/TRACE_END
+ * compile to nothing. Each thread appends TSC-stamped spans to its
+ * own ring with no locking, and the rings are linked into a list
+ * that SM2_TraceDump() walks. Rings live until the process exits so
+ * spans of finished threads can still be dumped; a ring that is
+ * still being written may show its oldest events torn.
+ * ----------------------------------------------------------------
+ */
+#ifdef HSM2_TRACE
+typedef struct
+{
+    U64 start;
+    U64 end;
+    U32 phase;
+    U32 arg;
+} trace_event_t;
+
+typedef struct trace_ring
+{
+    struct trace_ring *next;
+    int tid;
+
+    /* Events ever written, advanced only by the owning thread */
+    U64 head;
+    trace_event_t events[SM2_TRACE_EVENTS];
+} trace_ring_t;
+
+static trace_ring_t *trace_rings;
+static __thread trace_ring_t *trace_ring;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static U64 trace_tsc0, trace_ns0;
+
+static U64 trace_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+static void trace_calibrate(void)
+{
+    trace_ns0 = now_ns();
+    trace_tsc0 = trace_tsc();
+}
+
+static void trace_record(U32 phase, U64 start, U32 arg)
+{
+    trace_ring_t *ring = trace_ring;
+    U64 end = trace_tsc();
+    trace_event_t *ev;
+
+    if (ring == NULL)
+    {
+        pthread_once(&trace_once, trace_calibrate);
+        ring = (trace_ring_t *)calloc(1, sizeof(trace_ring_t));
+        if (ring == NULL)
+        {
+            return;
+        }
+        ring->tid = (int)syscall(SYS_gettid);
+        ring->next = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE);
+        while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+        {
+        }
+        trace_ring = ring;
+    }
+
+    ev = &ring->events[ring->head % SM2_TRACE_EVENTS];
+    ev->start = start;
+    ev->end = end;
+    ev->phase = phase;
+    ev->arg = arg;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+#endif
+
+int SM2_TraceDump(const char *path)
+{
+    /**
+     * @description: write every thread's recorded spans as a Chrome
+     *               trace, loadable in chrome://tracing or Perfetto
+     * @param: 
+     *          path - output JSON file
+     * @return: int
+     *          number of events written
+     *          -1 - file error, or tracing not built in
+     */
+#ifdef HSM2_TRACE
+    static const char *names[SM2_NUM_PHASES] = {
+        "discover", "map", "config", "shm", "init_code", "init_data",
+        "upload", "flush", "issue", "wait", "readback"};
+    const char *sep = "";
+    double ns_per_tick = 1.0;
+    int count = 0;
+    FILE *fp;
+
+    fp = fopen(path, "w");
+    if (fp == NULL)
+    {
+        printf("Open failed for file '%s': errno %d, %s\n", path, errno, strerror(errno));
+        return -1;
+    }
+
+    // TSC rate measured over the whole traced interval
+    pthread_once(&trace_once, trace_calibrate);
+    U64 ns1 = now_ns(), tsc1 = trace_tsc();
+    if (tsc1 > trace_tsc0 && ns1 > trace_ns0)
+    {
+        ns_per_tick = (double)(ns1 - trace_ns0) / (double)(tsc1 - trace_tsc0);
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (trace_ring_t *ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        U64 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        U64 first = head > SM2_TRACE_EVENTS ? head - SM2_TRACE_EVENTS : 0;
+
+        for (U64 i = first; i < head; i++)
+        {
+            const trace_event_t *ev = &ring->events[i % SM2_TRACE_EVENTS];
+            double ts = ((double)ev->start - (double)trace_tsc0) * ns_per_tick / 1000.0;
+            double dur = (double)(ev->end - ev->start) * ns_per_tick / 1000.0;
+
+            fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"hsm2\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                        "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"arg\":%u}}",
+                    sep, ev->phase < SM2_NUM_PHASES ? names[ev->phase] : "?", (int)getpid(), ring->tid,
+                    ts, dur, ev->arg);
+            sep = ",";
+            count++;
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    return count;
+#else
+    (void)path;
+    printf("Tracing not built in, compile with -DHSM2_TRACE\n");
+    return -1;
+#endif
+}
+
+/* ----------------------------------------------------------------
+ * Software device model
+ *
+ * open_device_sim() backs a device_t with an unlinked POSIX shared
+ * memory object laid out like BAR0 (two engines at BASE_ADDR0 and
+ * BASE_ADDR1, each with its DATA, PARAM, CMD and STATE words) and
+ * runs one thread per engine that executes the commands in software
+ * on the SM2 curve. The command write rings a doorbell that marks
+ * STATE busy before write_cmd() returns; the engine thread computes
+ * the result, holds it back until the configured latency has passed
+ * since the command (sleeping, then spinning the last SIM_SPIN_NS),
+ * then writes the outputs, clears STATE and raises the device's
+ * completion eventfd. A soft reset cancels a command the thread has
+ * already taken: its outputs, STATE and eventfd write are dropped.
+ * Setting $HSM2_SIM to a card count above 0 makes open_device() and
+ * open_all_devices() return simulated cards; unset or 0 leaves them
+ * on the real ones. Simulated cards are private to the process,
+ * with the control block kept in the same segment past the BAR;
+ * open_device_sim_peer() opens a second device_t on a card, as
+ * another process would. Their statistics go to the segment of
+ * BDF ffff:<card>:00.0.
+ * ----------------------------------------------------------------
+ */
+#define SIM_BAR_SIZE (2 * BASE_ADDR1)
+
+/* The card's control block follows its BAR in the same segment */
+#define SIM_SEGMENT_SIZE (SIM_BAR_SIZE + sizeof(SM2_shm_t))
+
+/* Tail of the modelled latency that is spun, nanosleep() overshoots by about this much */
+#define SIM_SPIN_NS 60000
+
+typedef struct
+{
+    U32 v[8]; // little-endian limbs
+} bn_t;
+
+typedef struct
+{
+    bn_t m;
+    bn_t rr; // R^2 mod m, R = 2^256
+    bn_t one; // R mod m
+    U32 m0inv; // -m^-1 mod 2^32
+} mont_t;
+
+typedef struct
+{
+    bn_t x, y, z; // Jacobian, Montgomery form; z = 0 at infinity
+} point_t;
+
+typedef struct
+{
+    device_t *dev;
+    U32 base_addr;
+    pthread_t thread;
+    pthread_cond_t doorbell;
+
+    /* Command waiting to run, 0 if none */
+    U32 cmd;
+    U64 issued_ns;
+
+    /* Soft resets so far; a taken command is dropped if this moved */
+    U32 resets;
+} sim_engine_t;
+
+struct SM2_sim
+{
+    pthread_mutex_t lock;
+    int stop;
+    U64 latency_ns[SM2_NUM_OPS];
+
+    /* 0 to only model timing; results are then left as they were */
+    int compute;
+    sim_engine_t engines[2];
+
+    /* Engine threads started, the ones sim_stop() joins */
+    int nthreads;
+};
+
+static const char *sm2_p = "FFFFFFFEFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF00000000FFFFFFFFFFFFFFFF";
+static const char *sm2_n = "FFFFFFFEFFFFFFFFFFFFFFFFFFFFFFFF7203DF6B21C6052B53BBF40939D54123";
+static const char *sm2_b = "28E9FA9E9D9F5E344D5A9E4BCF6509A7F39789F515AB8F92DDBCBD414D940E93";
+static const char *sm2_gx = "32C4AE2C1F1981195F9904466A39C9948FE30BBFF2660BE1715A4589334C74C7";
+static const char *sm2_gy = "BC3736A2F4F6779C59BDCEE36B692153D0A9877CC62A474002DF32E52139F0A0";
+
+static mont_t curve_p, curve_n;
+static bn_t curve_a, curve_b; // Montgomery form
+static point_t curve_g;
+static pthread_once_t curve_once = PTHREAD_ONCE_INIT;
+
+static void bn_from_hex(bn_t *r, const char *hex)
+{
+    memset(r, 0, sizeof(bn_t));
+    for (int i = 0; i < 64; i++)
+    {
+        int c = hex[63 - i];
+        U32 nibble = c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+        r->v[i / 8] |= nibble << (4 * (i % 8));
+    }
+}
+
+static void bn_from_words(bn_t *r, const U32 *w)
+{
+    // the engine keeps the most significant word first
+    for (int i = 0; i < 8; i++)
+    {
+        r->v[7 - i] = w[i];
+    }
+}
+
+static void bn_to_words(U32 *w, const bn_t *a)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        w[i] = a->v[7 - i];
+    }
+}
+
+static int bn_is_zero(const bn_t *a)
+{
+    U32 acc = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        acc |= a->v[i];
+    }
+    return acc == 0;
+}
+
+static int bn_cmp(const bn_t *a, const bn_t *b)
+{
+    for (int i = 7; i >= 0; i--)
+    {
+        if (a->v[i] != b->v[i])
+        {
+            return a->v[i] > b->v[i] ? 1 : -1;
+        }
+    }
+    return 0;
+}
+
+static U32 bn_add(bn_t *r, const bn_t *a, const bn_t *b)
+{
+    U64 carry = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        carry += (U64)a->v[i] + b->v[i];
+        r->v[i] = (U32)carry;
+        carry >>= 32;
+    }
+    return (U32)carry;
+}
+
+static U32 bn_sub(bn_t *r, const bn_t *a, const bn_t *b)
+{
+    U64 borrow = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        U64 d = (U64)a->v[i] - b->v[i] - borrow;
+        r->v[i] = (U32)d;
+        borrow = (d >> 32) & 1;
+    }
+    return (U32)borrow;
+}
+
+static void mod_add(bn_t *r, const bn_t *a, const bn_t *b, const mont_t *m)
+{
+    if (bn_add(r, a, b) || bn_cmp(r, &m->m) >= 0)
+    {
+        bn_sub(r, r, &m->m);
+    }
+}
+
+static void mod_sub(bn_t *r, const bn_t *a, const bn_t *b, const mont_t *m)
+{
+    if (bn_sub(r, a, b))
+    {
+        bn_add(r, r, &m->m);
+    }
+}
+
+static void mod_reduce(bn_t *r, const mont_t *m)
+{
+    // inputs are below 2^256 < 2m
+    if (bn_cmp(r, &m->m) >= 0)
+    {
+        bn_sub(r, r, &m->m);
+    }
+}
+
+static void mont_mul(bn_t *r, const bn_t *a, const bn_t *b, const mont_t *m)
+{
+    // CIOS
+    U32 t[10] = {0};
+    for (int i = 0; i < 8; i++)
+    {
+        U64 c = 0;
+        for (int j = 0; j < 8; j++)
+        {
+            c += (U64)t[j] + (U64)a->v[j] * b->v[i];
+            t[j] = (U32)c;
+            c >>= 32;
+        }
+        c += t[8];
+        t[8] = (U32)c;
+        t[9] = (U32)(c >> 32);
+
+        U32 q = t[0] * m->m0inv;
+        c = ((U64)t[0] + (U64)q * m->m.v[0]) >> 32;
+        for (int j = 1; j < 8; j++)
+        {
+            c += (U64)t[j] + (U64)q * m->m.v[j];
+            t[j - 1] = (U32)c;
+            c >>= 32;
+        }
+        c += t[8];
+        t[7] = (U32)c;
+        t[8] = t[9] + (U32)(c >> 32);
+    }
+    memcpy(r->v, t, sizeof(r->v));
+    if (t[8] || bn_cmp(r, &m->m) >= 0)
+    {
+        bn_sub(r, r, &m->m);
+    }
+}
+
+static void mont_setup(mont_t *m, const char *hex)
+{
+    U32 inv = 1;
+
+    bn_from_hex(&m->m, hex);
+    // Newton iteration for m^-1 mod 2^32
+    for (int i = 0; i < 5; i++)
+    {
+        inv *= 2 - m->m.v[0] * inv;
+    }
+    m->m0inv = -inv;
+
+    // R mod m = 2^256 - m, since m > 2^255; then double up to R^2
+    memset(&m->one, 0, sizeof(bn_t));
+    bn_sub(&m->one, &m->one, &m->m);
+    m->rr = m->one;
+    for (int i = 0; i < 256; i++)
+    {
+        mod_add(&m->rr, &m->rr, &m->rr, m);
+    }
+}
+
+static void mont_to(bn_t *r, const bn_t *a, const mont_t *m)
+{
+    mont_mul(r, a, &m->rr, m);
+}
+
+static void mont_from(bn_t *r, const bn_t *a, const mont_t *m)
+{
+    bn_t one = {{1}};
+    mont_mul(r, a, &one, m);
+}
+
+static void mont_inv(bn_t *r, const bn_t *a, const mont_t *m)
+{
+    // a^(m-2), a and r in Montgomery form
+    bn_t e, two = {{2}}, acc = m->one;
+    bn_sub(&e, &m->m, &two);
+    for (int i = 255; i >= 0; i--)
+    {
+        mont_mul(&acc, &acc, &acc, m);
+        if ((e.v[i / 32] >> (i % 32)) & 1)
+        {
+            mont_mul(&acc, &acc, a, m);
+        }
+    }
+    *r = acc;
+}
+
+static void curve_setup(void)
+{
+    bn_t three = {{3}}, t;
+
+    mont_setup(&curve_p, sm2_p);
+    mont_setup(&curve_n, sm2_n);
+    mod_sub(&t, &curve_p.m, &three, &curve_p);
+    mont_to(&curve_a, &t, &curve_p);
+    bn_from_hex(&t, sm2_b);
+    mont_to(&curve_b, &t, &curve_p);
+    bn_from_hex(&t, sm2_gx);
+    mont_to(&curve_g.x, &t, &curve_p);
+    bn_from_hex(&t, sm2_gy);
+    mont_to(&curve_g.y, &t, &curve_p);
+    curve_g.z = curve_p.one;
+}
+
+static void point_double(point_t *r, const point_t *a)
+{
+    // a = -3: alpha = 3 (X - Z^2)(X + Z^2)
+    const mont_t *m = &curve_p;
+    bn_t delta, gamma, beta, alpha, t1, t2;
+
+    if (bn_is_zero(&a->z))
+    {
+        *r = *a;
+        return;
+    }
+    mont_mul(&delta, &a->z, &a->z, m);
+    mont_mul(&gamma, &a->y, &a->y, m);
+    mont_mul(&beta, &a->x, &gamma, m);
+    mod_sub(&t1, &a->x, &delta, m);
+    mod_add(&t2, &a->x, &delta, m);
+    mont_mul(&alpha, &t1, &t2, m);
+    mod_add(&t1, &alpha, &alpha, m);
+    mod_add(&alpha, &alpha, &t1, m);
+
+    mod_add(&t1, &a->y, &a->z, m);
+    mont_mul(&t1, &t1, &t1, m);
+    mod_sub(&t1, &t1, &gamma, m);
+    mod_sub(&r->z, &t1, &delta, m);
+
+    mod_add(&beta, &beta, &beta, m);
+    mod_add(&beta, &beta, &beta, m); // 4 beta
+    mont_mul(&t1, &alpha, &alpha, m);
+    mod_add(&t2, &beta, &beta, m);
+    mod_sub(&r->x, &t1, &t2, m);
+
+    mod_sub(&t1, &beta, &r->x, m);
+    mont_mul(&t1, &alpha, &t1, m);
+    mont_mul(&gamma, &gamma, &gamma, m);
+    mod_add(&gamma, &gamma, &gamma, m);
+    mod_add(&gamma, &gamma, &gamma, m);
+    mod_add(&gamma, &gamma, &gamma, m); // 8 gamma^2
+    mod_sub(&r->y, &t1, &gamma, m);
+}
+
+static void point_add(point_t *r, const point_t *a, const point_t *b)
+{
+    const mont_t *m = &curve_p;
+    bn_t z1z1, z2z2, u1, u2, s1, s2, h, hh, hhh, rr, t;
+
+    if (bn_is_zero(&a->z))
+    {
+        *r = *b;
+        return;
+    }
+    if (bn_is_zero(&b->z))
+    {
+        *r = *a;
+        return;
+    }
+    mont_mul(&z1z1, &a->z, &a->z, m);
+    mont_mul(&z2z2, &b->z, &b->z, m);
+    mont_mul(&u1, &a->x, &z2z2, m);
+    mont_mul(&u2, &b->x, &z1z1, m);
+    mont_mul(&s1, &a->y, &z2z2, m);
+    mont_mul(&s1, &s1, &b->z, m);
+    mont_mul(&s2, &b->y, &z1z1, m);
+    mont_mul(&s2, &s2, &a->z, m);
+
+    mod_sub(&h, &u2, &u1, m);
+    mod_sub(&rr, &s2, &s1, m);
+    if (bn_is_zero(&h))
+    {
+        if (bn_is_zero(&rr))
+        {
+            point_double(r, a);
+        }
+        else
+        {
+            memset(r, 0, sizeof(point_t));
+        }
+        return;
+    }
+
+    mont_mul(&hh, &h, &h, m);
+    mont_mul(&hhh, &hh, &h, m);
+    mont_mul(&u1, &u1, &hh, m);
+    mont_mul(&t, &a->z, &b->z, m);
+    mont_mul(&r->z, &t, &h, m);
+
+    mont_mul(&t, &rr, &rr, m);
+    mod_sub(&t, &t, &hhh, m);
+    mod_sub(&t, &t, &u1, m);
+    mod_sub(&r->x, &t, &u1, m);
+
+    mod_sub(&t, &u1, &r->x, m);
+    mont_mul(&t, &rr, &t, m);
+    mont_mul(&s1, &s1, &hhh, m);
+    mod_sub(&r->y, &t, &s1, m);
+}
+
+static void point_mul(point_t *r, const bn_t *k, const point_t *a)
+{
+    point_t acc;
+
+    memset(&acc, 0, sizeof(point_t));
+    for (int i = 255; i >= 0; i--)
+    {
+        point_double(&acc, &acc);
+        if ((k->v[i / 32] >> (i % 32)) & 1)
+        {
+            point_add(&acc, &acc, a);
+        }
+    }
+    *r = acc;
+}
+
+static int point_from_words(point_t *r, const U32 *w)
+{
+    // affine x || y; returns -1 if the point is not on the curve
+    const mont_t *m = &curve_p;
+    bn_t x, y, lhs, rhs;
+
+    bn_from_words(&x, w);
+    bn_from_words(&y, w + 8);
+    if (bn_cmp(&x, &m->m) >= 0 || bn_cmp(&y, &m->m) >= 0)
+    {
+        return -1;
+    }
+    mont_to(&r->x, &x, m);
+    mont_to(&r->y, &y, m);
+    r->z = m->one;
+
+    mont_mul(&lhs, &r->y, &r->y, m);
+    mont_mul(&rhs, &r->x, &r->x, m);
+    mod_add(&rhs, &rhs, &curve_a, m);
+    mont_mul(&rhs, &rhs, &r->x, m);
+    mod_add(&rhs, &rhs, &curve_b, m);
+    return bn_cmp(&lhs, &rhs) == 0 ? 0 : -1;
+}
+
+static int point_to_affine(bn_t *x, bn_t *y, const point_t *a)
+{
+    const mont_t *m = &curve_p;
+    bn_t zi, zi2;
+
+    if (bn_is_zero(&a->z))
+    {
+        return -1;
+    }
+    mont_inv(&zi, &a->z, m);
+    mont_mul(&zi2, &zi, &zi, m);
+    mont_mul(x, &a->x, &zi2, m);
+    mont_mul(&zi2, &zi2, &zi, m);
+    mont_mul(y, &a->y, &zi2, m);
+    mont_from(x, x, m);
+    mont_from(y, y, m);
+    return 0;
+}
+
+static int point_to_words(U32 *w, const point_t *a)
+{
+    bn_t x, y;
+    if (point_to_affine(&x, &y, a) < 0)
+    {
+        return -1;
+    }
+    bn_to_words(w, &x);
+    bn_to_words(w + 8, &y);
+    return 0;
+}
+
+static void scalar_mul(bn_t *r, const bn_t *a, const bn_t *b)
+{
+    // a * b mod n for plain (non-Montgomery) a, b
+    bn_t am;
+    mont_to(&am, a, &curve_n);
+    mont_mul(r, &am, b, &curve_n);
+}
+
+static void scalar_from_words(bn_t *r, const U32 *w)
+{
+    bn_from_words(r, w);
+    mod_reduce(r, &curve_n);
+}
+
+static U32 sim_genkey(U32 *d)
+{
+    // in: rand at 0; out: pri_key at 0, pub_key at 8
+    bn_t k, lim, one = {{1}};
+    point_t p;
+
+    scalar_from_words(&k, d);
+    bn_sub(&lim, &curve_n.m, &one);
+    if (bn_is_zero(&k) || bn_cmp(&k, &lim) >= 0)
+    {
+        return 2;
+    }
+    point_mul(&p, &k, &curve_g);
+    bn_to_words(d, &k);
+    return point_to_words(d + 8, &p) < 0 ? 2 : 0;
+}
+
+static U32 sim_sign(U32 *d)
+{
+    // in: rand at 0, pri_key at 8, hash at 16; out: r, s at 24
+    bn_t k, pri, e, x, y, r, s, t, one = {{1}};
+    point_t p;
+
+    scalar_from_words(&k, d);
+    scalar_from_words(&pri, d + 8);
+    scalar_from_words(&e, d + 16);
+    if (bn_is_zero(&k))
+    {
+        return 2;
+    }
+
+    point_mul(&p, &k, &curve_g);
+    point_to_affine(&x, &y, &p);
+    mod_reduce(&x, &curve_n);
+    mod_add(&r, &e, &x, &curve_n);
+    mod_add(&t, &r, &k, &curve_n);
+    if (bn_is_zero(&r) || bn_is_zero(&t))
+    {
+        return 2;
+    }
+
+    // s = (1 + d)^-1 (k - r d) mod n
+    mod_add(&t, &pri, &one, &curve_n);
+    mont_to(&t, &t, &curve_n);
+    mont_inv(&t, &t, &curve_n);
+    scalar_mul(&s, &r, &pri);
+    mod_sub(&s, &k, &s, &curve_n);
+    mont_mul(&s, &s, &t, &curve_n);
+    if (bn_is_zero(&s))
+    {
+        return 2;
+    }
+    bn_to_words(d + 24, &r);
+    bn_to_words(d + 32, &s);
+    return 0;
+}
+
+static U32 sim_verify(U32 *d)
+{
+    // in: pub_key at 0, hash at 16, r, s at 24; STATE check bit only
+    bn_t e, r, s, t, x, y;
+    point_t pub, p1, p2;
+
+    bn_from_words(&r, d + 24);
+    bn_from_words(&s, d + 32);
+    if (point_from_words(&pub, d) < 0 || bn_is_zero(&r) || bn_is_zero(&s) ||
+        bn_cmp(&r, &curve_n.m) >= 0 || bn_cmp(&s, &curve_n.m) >= 0)
+    {
+        return 2;
+    }
+    scalar_from_words(&e, d + 16);
+    mod_add(&t, &r, &s, &curve_n);
+    if (bn_is_zero(&t))
+    {
+        return 2;
+    }
+
+    point_mul(&p1, &s, &curve_g);
+    point_mul(&p2, &t, &pub);
+    point_add(&p1, &p1, &p2);
+    if (point_to_affine(&x, &y, &p1) < 0)
+    {
+        return 2;
+    }
+    mod_reduce(&x, &curve_n);
+    mod_add(&t, &e, &x, &curve_n);
+    return bn_cmp(&t, &r) == 0 ? 0 : 2;
+}
+
+static U32 sim_encrypt(U32 *d)
+{
+    // in: rand at 0, pub_key at 8; out: C1 = kG at 24, S = kP at 40
+    bn_t k;
+    point_t pub, p;
+
+    scalar_from_words(&k, d);
+    if (bn_is_zero(&k) || point_from_words(&pub, d + 8) < 0)
+    {
+        return 2;
+    }
+    point_mul(&p, &k, &curve_g);
+    point_to_words(d + 24, &p);
+    point_mul(&p, &k, &pub);
+    return point_to_words(d + 40, &p) < 0 ? 2 : 0;
+}
+
+static U32 sim_decrypt(U32 *d)
+{
+    // in: pri_key at 0, C1 at 8; out: S = d C1 at 24
+    bn_t k;
+    point_t c1, p;
+
+    scalar_from_words(&k, d);
+    if (point_from_words(&c1, d + 8) < 0)
+    {
+        return 2;
+    }
+    point_mul(&p, &k, &c1);
+    return point_to_words(d + 24, &p) < 0 ? 2 : 0;
+}
+
+static void x_bar(bn_t *r, const bn_t *x)
+{
+    // 2^127 + (x mod 2^127)
+    memset(r, 0, sizeof(bn_t));
+    memcpy(r->v, x->v, 4 * sizeof(U32));
+    r->v[3] = (r->v[3] & 0x7fffffff) | 0x80000000;
+}
+
+static U32 sim_keyx(U32 *d)
+{
+    // in: self_r at 0, self_Rx at 8, self_d at 16, other_R at 24, other_P at 40
+    // out: UV = t_A (P_B + x_B R_B) at 56, cofactor 1
+    bn_t r, rx, pri, xa, xb, t;
+    point_t rb, pb, p;
+
+    scalar_from_words(&r, d);
+    bn_from_words(&rx, d + 8);
+    scalar_from_words(&pri, d + 16);
+    if (point_from_words(&rb, d + 24) < 0 || point_from_words(&pb, d + 40) < 0)
+    {
+        return 2;
+    }
+    x_bar(&xa, &rx);
+    bn_from_words(&t, d + 24);
+    x_bar(&xb, &t);
+
+    scalar_mul(&t, &xa, &r);
+    mod_add(&t, &t, &pri, &curve_n);
+    point_mul(&p, &xb, &rb);
+    point_add(&p, &p, &pb);
+    point_mul(&p, &t, &p);
+    return point_to_words(d + 56, &p) < 0 ? 2 : 0;
+}
+
+static U32 sim_execute(device_t *dev, U32 base_addr, U32 cmd, U32 *d, U32 *out_off, U32 *out_len)
+{
+    // the engine works on a private copy; the caller writes back d[out_off, out_off + out_len)
+    volatile U32 *window = (volatile U32 *)(dev->addr + base_addr + DATA_ADDR * sizeof(U32));
+    U32 status;
+
+    for (int i = 0; i < SM2_SHADOW_WORDS; i++)
+    {
+        d[i] = window[i];
+    }
+    *out_off = 0, *out_len = 0;
+    switch (cmd)
+    {
+    case CMD_GENKEY:
+        status = sim_genkey(d);
+        *out_off = 0, *out_len = 24;
+        break;
+    case CMD_SIGN:
+        status = sim_sign(d);
+        *out_off = 24, *out_len = 16;
+        break;
+    case CMD_VERIFY:
+        status = sim_verify(d);
+        break;
+    case CMD_ENCRYPT:
+        status = sim_encrypt(d);
+        *out_off = 24, *out_len = 32;
+        break;
+    case CMD_DECRYPT:
+        status = sim_decrypt(d);
+        *out_off = 24, *out_len = 16;
+        break;
+    case CMD_KEYX:
+        status = sim_keyx(d);
+        *out_off = 56, *out_len = 16;
+        break;
+    default:
+        // CMD_INIT1, CMD_INIT2: the code and tables stay where they were written
+        status = 0;
+        break;
+    }
+    return status;
+}
+
+static void *sim_engine_main(void *arg)
+{
+    sim_engine_t *engine = (sim_engine_t *)arg;
+    device_t *dev = engine->dev;
+    SM2_sim_t *sim = dev->sim;
+    volatile U32 *window = (volatile U32 *)(dev->addr + engine->base_addr + DATA_ADDR * sizeof(U32));
+    volatile U32 *state = (volatile U32 *)(dev->addr + engine->base_addr + STATE_ADDR * sizeof(U32));
+    U32 d[SM2_SHADOW_WORDS];
+    U64 one = 1;
+
+    pthread_mutex_lock(&sim->lock);
+    for (;;)
+    {
+        while (!sim->stop && engine->cmd == 0)
+        {
+            pthread_cond_wait(&engine->doorbell, &sim->lock);
+        }
+        if (sim->stop)
+        {
+            break;
+        }
+        U32 cmd = engine->cmd;
+        U32 resets = engine->resets;
+        U64 due = engine->issued_ns + sim->latency_ns[op_index(cmd)];
+        int compute = sim->compute;
+        U32 out_off = 0, out_len = 0;
+        engine->cmd = 0;
+        pthread_mutex_unlock(&sim->lock);
+
+        U32 status = compute ? sim_execute(dev, engine->base_addr, cmd, d, &out_off, &out_len) : 0;
+
+        // sleep off the latency unless a soft reset or close comes first;
+        // the wakeup lands tens of microseconds late, so spin the tail
+        pthread_mutex_lock(&sim->lock);
+        if (due > now_ns() + SIM_SPIN_NS)
+        {
+            struct timespec ts = {.tv_sec = (due - SIM_SPIN_NS) / 1000000000ULL,
+                                  .tv_nsec = (due - SIM_SPIN_NS) % 1000000000ULL};
+            while (!sim->stop && engine->resets == resets)
+            {
+                if (pthread_cond_timedwait(&engine->doorbell, &sim->lock, &ts) == ETIMEDOUT)
+                {
+                    break;
+                }
+            }
+        }
+        pthread_mutex_unlock(&sim->lock);
+        while (now_ns() < due && __atomic_load_n(&engine->resets, __ATOMIC_RELAXED) == resets)
+        {
+            cpu_relax();
+        }
+
+        pthread_mutex_lock(&sim->lock);
+        // a soft reset since the command was taken cancels it
+        if (engine->resets != resets)
+        {
+            continue;
+        }
+        for (U32 i = out_off; i < out_off + out_len; i++)
+        {
+            window[i] = d[i];
+        }
+        __atomic_store_n(state, status, __ATOMIC_RELEASE);
+        if (write(dev->irq_fd, &one, sizeof(one)) < 0)
+        {
+            // nobody listening, STATE is enough
+        }
+    }
+    pthread_mutex_unlock(&sim->lock);
+    return NULL;
+}
+
+static void sim_doorbell(device_t *dev, U32 base_addr, U32 cmd)
+{
+    SM2_sim_t *sim = dev->sim;
+    sim_engine_t *engine = &sim->engines[ENGINE_INDEX(base_addr)];
+    volatile U32 *state = (volatile U32 *)(dev->addr + base_addr + STATE_ADDR * sizeof(U32));
+
+    // a soft reset is instant and drops whatever was queued or running
+    if (cmd == CMD_SOFTRST)
+    {
+        pthread_mutex_lock(&sim->lock);
+        engine->cmd = 0;
+        engine->resets++;
+        *state = 0;
+        pthread_cond_signal(&engine->doorbell);
+        pthread_mutex_unlock(&sim->lock);
+        return;
+    }
+
+    *state = 1;
+    pthread_mutex_lock(&sim->lock);
+    engine->cmd = cmd;
+    engine->issued_ns = now_ns();
+    pthread_cond_signal(&engine->doorbell);
+    pthread_mutex_unlock(&sim->lock);
+}
+
+static void sim_stop(device_t *dev)
+{
+    SM2_sim_t *sim = dev->sim;
+
+    // a peer only borrows the card's engine threads
+    if (sim->engines[0].dev != dev)
+    {
+        dev->sim = NULL;
+        return;
+    }
+
+    pthread_mutex_lock(&sim->lock);
+    sim->stop = 1;
+    for (int i = 0; i < 2; i++)
+    {
+        pthread_cond_signal(&sim->engines[i].doorbell);
+    }
+    pthread_mutex_unlock(&sim->lock);
+    for (int i = 0; i < sim->nthreads; i++)
+    {
+        pthread_join(sim->engines[i].thread, NULL);
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        pthread_cond_destroy(&sim->engines[i].doorbell);
+    }
+    pthread_mutex_destroy(&sim->lock);
+    free(sim);
+    dev->sim = NULL;
+}
+
+void device_sim_set_latency(device_t *dev, int op, U64 ns)
+{
+    /**
+     * @description: set how long a simulated engine takes for one opcode
+     * @param: 
+     *          op - SM2_OP_*, SM2_OP_INIT for CMD_INIT1/CMD_INIT2
+     *          ns - minimum time from command write to completion
+     */
+    if (dev->sim != NULL && op >= 0 && op < SM2_NUM_OPS)
+    {
+        pthread_mutex_lock(&dev->sim->lock);
+        dev->sim->latency_ns[op] = ns;
+        pthread_mutex_unlock(&dev->sim->lock);
+    }
+}
+
+void device_sim_set_compute(device_t *dev, int enable)
+{
+    /**
+     * @description: switch the SM2 arithmetic of a simulated card on or
+     *               off; the software curve math takes about a
+     *               millisecond per point multiplication, well above the
+     *               card, so timing-only runs skip it
+     */
+    if (dev->sim != NULL)
+    {
+        pthread_mutex_lock(&dev->sim->lock);
+        dev->sim->compute = enable;
+        pthread_mutex_unlock(&dev->sim->lock);
+    }
+}
+
+static int sim_cards(void)
+{
+    // $HSM2_SIM unset, 0 or not a number leaves the real cards in use
+    const char *sim = getenv("HSM2_SIM");
+    return sim != NULL ? atoi(sim) : 0;
+}
+
+static int sim_map_control_block(device_t *dev)
+{
+    dev->shm = (SM2_shm_t *)mmap(NULL, sizeof(SM2_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, SIM_BAR_SIZE);
+    if (dev->shm == (SM2_shm_t *)MAP_FAILED)
+    {
+        printf("mmap() of the control block of '%s' failed: errno %d, %s\n", dev->filename, errno, strerror(errno));
+        dev->shm = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int open_device_sim(int card, device_t **dev)
+{
+    /**
+     * @description: open a software model of an HSM2 card
+     * @param: 
+     *          card - index of the simulated card, gives its BDF ffff:<card>:00.0
+     *          dev - returned device, NULL on failure
+     * @return: int
+     *          0 - success
+     *          -1 - shared memory, mapping or thread setup failed
+     */
+    // roughly what the card takes per command
+    static const U64 latency_ns[SM2_NUM_OPS] = {60000, 70000, 140000, 140000, 70000, 150000, 500000};
+    device_info_t info = {.domain = 0xffff, .bus = (U32)card, .numa_node = -1, .bar_size = SIM_BAR_SIZE};
+    pthread_condattr_t attr;
+    char boot_id[40];
+    SM2_sim_t *sim;
+
+    pthread_once(&curve_once, curve_setup);
+
+    // unlinked straight away, so the BAR is private to this process
+    *dev = alloc_device(&info);
+    if (*dev == NULL)
+    {
+        return -1;
+    }
+    snprintf((*dev)->filename, sizeof((*dev)->filename), "/hsm2-sim-%d-%d", (int)getpid(), card);
+    (*dev)->fd = shm_open((*dev)->filename, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if ((*dev)->fd < 0)
+    {
+        printf("shm_open() of '%s' failed: errno %d, %s\n", (*dev)->filename, errno, strerror(errno));
+        goto fail_free;
+    }
+    shm_unlink((*dev)->filename);
+    if (ftruncate((*dev)->fd, SIM_SEGMENT_SIZE) < 0)
+    {
+        printf("ftruncate() of '%s' failed: errno %d, %s\n", (*dev)->filename, errno, strerror(errno));
+        goto fail_close;
+    }
+    (*dev)->size = SIM_BAR_SIZE;
+    (*dev)->maddr = (U8 *)mmap(NULL, SIM_BAR_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, (*dev)->fd, 0);
+    if ((*dev)->maddr == (U8 *)MAP_FAILED)
+    {
+        printf("mmap() of simulated card %d failed: errno %d, %s\n", card, errno, strerror(errno));
+        goto fail_close;
+    }
+    (*dev)->addr = (*dev)->maddr;
+    if (sim_map_control_block(*dev) < 0)
+    {
+        goto fail_unmap;
+    }
+    read_boot_id(boot_id, sizeof(boot_id));
+    control_block_reset((*dev)->shm, boot_id);
+
+    sim = (SM2_sim_t *)calloc(1, sizeof(SM2_sim_t));
+    if (sim == NULL)
+    {
+        munmap((*dev)->shm, sizeof(SM2_shm_t));
+        goto fail_unmap;
+    }
+    memcpy(sim->latency_ns, latency_ns, sizeof(latency_ns));
+    sim->compute = 1;
+    pthread_mutex_init(&sim->lock, NULL);
+    // the engine threads time their latency on CLOCK_MONOTONIC, as now_ns()
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    for (int i = 0; i < 2; i++)
+    {
+        sim->engines[i].dev = *dev;
+        sim->engines[i].base_addr = i == 0 ? BASE_ADDR0 : BASE_ADDR1;
+        pthread_cond_init(&sim->engines[i].doorbell, &attr);
+    }
+    pthread_condattr_destroy(&attr);
+    (*dev)->sim = sim;
+    device_attach_eventfd(*dev, eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+    map_stats_block(*dev);
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (pthread_create(&sim->engines[i].thread, NULL, sim_engine_main, &sim->engines[i]) != 0)
+        {
+            printf("Thread for simulated card %d failed\n", card);
+            // stops the engine threads already started and unmaps everything
+            close_device(*dev);
+            *dev = NULL;
+            return -1;
+        }
+        sim->nthreads++;
+    }
+    HSM2_PROBE2(open, HSM2_BDF(*dev), (*dev)->size);
+    printf("simulated device %s opened!\n", (*dev)->filename);
+    return 0;
+
+fail_unmap:
+    munmap((*dev)->maddr, (*dev)->size);
+fail_close:
+    close((*dev)->fd);
+fail_free:
+    free(*dev);
+    *dev = NULL;
+    return -1;
+}
+
+int open_device_sim_peer(device_t *card, device_t **dev)
+{
+    /**
+     * @description: open a second device_t on a simulated card, standing in
+     *               for another process: it shares the card's engines and
+     *               control block but keeps its own mappings and shadow, and
+     *               polls STATE as it gets no interrupt
+     * @param: 
+     *          card - device_t from open_device_sim(), closed after the peer
+     *          dev - returned device, NULL on failure
+     * @return: int
+     *          0 - success
+     *          -1 - not a simulated card, or the mapping failed
+     */
+    device_info_t info = {.domain = card->domain, .bus = card->bus, .numa_node = -1, .bar_size = SIM_BAR_SIZE};
+
+    *dev = NULL;
+    if (card->sim == NULL)
+    {
+        return -1;
+    }
+    *dev = alloc_device(&info);
+    if (*dev == NULL)
+    {
+        return -1;
+    }
+    snprintf((*dev)->filename, sizeof((*dev)->filename), "%s", card->filename);
+    (*dev)->fd = dup(card->fd);
+    if ((*dev)->fd < 0)
+    {
+        goto fail_free;
+    }
+    (*dev)->size = SIM_BAR_SIZE;
+    (*dev)->maddr = (U8 *)mmap(NULL, SIM_BAR_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, (*dev)->fd, 0);
+    if ((*dev)->maddr == (U8 *)MAP_FAILED)
+    {
+        printf("mmap() of '%s' failed: errno %d, %s\n", (*dev)->filename, errno, strerror(errno));
+        goto fail_close;
+    }
+    (*dev)->addr = (*dev)->maddr;
+    if (sim_map_control_block(*dev) < 0)
+    {
+        munmap((*dev)->maddr, (*dev)->size);
+        goto fail_close;
+    }
+    (*dev)->sim = card->sim;
+    map_stats_block(*dev);
+    return 0;
+
+fail_close:
+    close((*dev)->fd);
+fail_free:
+    free(*dev);
+    *dev = NULL;
+    return -1;
+}
+
+/* ----------------------------------------------------------------
+ * Engine pool
+ *
+ * The pool owns both engines (BASE_ADDR0, BASE_ADDR1) of every card
+ * it is given. An engine's DATA window belongs to exactly one caller
+ * between pool_acquire() and pool_release(), so concurrent threads
+ * never interleave their uploads. The SM2_Pool* calls route by key,
+ * so repeated use of a key tends to find it already uploaded.
+ * ----------------------------------------------------------------
+ */
+int pool_create(SM2_pool_t **pool, device_t **devs, int ndev, int flags)
+{
+    /**
+     * @description: build a pool over every engine of the given cards
+     * @param: 
+     *          pool - returned pool
+     *          devs - opened cards
+     *          ndev - number of cards
+     *          flags - SM2_POOL_LAZY_INIT to bring engines up on first use
+     * @return: int
+     *          0 - success
+     *          -1 - no cards or out of memory
+     */
+    const U32 bases[2] = {BASE_ADDR0, BASE_ADDR1};
+
+    if (ndev <= 0)
+    {
+        printf("Engine pool needs at least one device\n");
+        return -1;
+    }
+
+    *pool = (SM2_pool_t *)malloc(sizeof(SM2_pool_t));
+    if (*pool == NULL)
+    {
+        return -1;
+    }
+    memset(*pool, 0, sizeof(SM2_pool_t));
+
+    (*pool)->engines = (engine_t *)calloc(ndev * 2, sizeof(engine_t));
+    if ((*pool)->engines == NULL)
+    {
+        free(*pool);
+        return -1;
+    }
+
+    for (int i = 0; i < ndev; i++)
+    {
+        for (int j = 0; j < 2; j++)
+        {
+            engine_t *engine = &(*pool)->engines[(*pool)->nengines++];
+            engine->dev = devs[i];
+            engine->base_addr = bases[j];
+        }
+    }
+    if (!(flags & SM2_POOL_LAZY_INIT))
+    {
+        SM2_InitEngines((*pool)->engines, (*pool)->nengines);
+    }
+
+    pthread_mutex_init(&(*pool)->lock, NULL);
+    pthread_cond_init(&(*pool)->freed, NULL);
+    return 0;
+}
+
+void pool_destroy(SM2_pool_t *pool)
+{
+    // recovery threads still reference the engines
+    pthread_mutex_lock(&pool->lock);
+    while (pool->recovering > 0)
+    {
+        pthread_cond_wait(&pool->freed, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_cond_destroy(&pool->freed);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->engines);
+    free(pool);
+}
+
+static engine_t *claim_engine(SM2_pool_t *pool, int prefer)
+{
+    // called with pool->lock held; quarantined engines stay busy
+    if (prefer >= 0 && !pool->engines[prefer].busy)
+    {
+        pool->engines[prefer].busy = 1;
+        return &pool->engines[prefer];
+    }
+    for (int i = 0; i < pool->nengines; i++)
+    {
+        int k = (pool->next + i) % pool->nengines;
+        if (!pool->engines[k].busy)
+        {
+            pool->engines[k].busy = 1;
+            pool->next = k + 1;
+            return &pool->engines[k];
+        }
+    }
+    return NULL;
+}
+
+static int pool_out_of_service(SM2_pool_t *pool)
+{
+    // called with pool->lock held
+    if (pool->recovering > 0)
+    {
+        return 0;
+    }
+    for (int i = 0; i < pool->nengines; i++)
+    {
+        if (!pool->engines[i].quarantined)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int engine_bring_up(engine_t *engine)
+{
+    // lazy pools bring an engine up the first time it is handed out
+    if (!engine->ready)
+    {
+        if (init_warm_owned(engine->dev, engine->base_addr) < 0)
+        {
+            return SM2_TIMEDOUT;
+        }
+        engine->ready = 1;
+    }
+    return 0;
+}
+
+static void unclaim_engine(SM2_pool_t *pool, engine_t *engine)
+{
+    pthread_mutex_lock(&pool->lock);
+    engine->busy = 0;
+    pthread_cond_signal(&pool->freed);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+typedef struct
+{
+    SM2_pool_t *pool;
+    engine_t *engine;
+} recovery_t;
+
+static void *engine_recover(void *arg)
+{
+    recovery_t *r = (recovery_t *)arg;
+    engine_t *engine = r->engine;
+    SM2_pool_t *pool = r->pool;
+    int check = SM2_TIMEDOUT;
+
+    free(r);
+    // without the lock the engine may be another process's; leave it alone
+    if (device_lock_engine(engine->dev, engine->base_addr) == 0)
+    {
+        for (int tries = 0; tries < 3 && check != 0; tries++)
+        {
+            if (tries > 0)
+            {
+                sleep_ns(1000000ULL << tries);
+            }
+            check = SM2_Recover(engine->dev, engine->base_addr);
+        }
+        device_unlock_engine(engine->dev, engine->base_addr);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (check == 0)
+    {
+        engine->ready = 1;
+        engine->quarantined = 0;
+        engine->busy = 0;
+    }
+    else
+    {
+        printf("Engine %d of %04x:%02x:%02x.%1x taken out of service\n", ENGINE_INDEX(engine->base_addr),
+               engine->dev->domain, engine->dev->bus, engine->dev->slot, engine->dev->function);
+    }
+    pool->recovering--;
+    pthread_cond_broadcast(&pool->freed);
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void pool_quarantine(SM2_pool_t *pool, engine_t *engine)
+{
+    /**
+     * @description: take a hung engine out of the pool and recover it
+     *               in the background; replaces pool_release()
+     */
+    recovery_t *r = (recovery_t *)malloc(sizeof(recovery_t));
+    pthread_attr_t attr;
+    pthread_t tid;
+    int started = 0;
+
+    // the robust lock is per thread, the recovery thread takes it anew
+    device_unlock_engine(engine->dev, engine->base_addr);
+
+    pthread_mutex_lock(&pool->lock);
+    engine->quarantined = 1;
+    engine->ready = 0;
+    pool->recovering++;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (r != NULL)
+    {
+        r->pool = pool;
+        r->engine = engine;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        started = pthread_create(&tid, &attr, engine_recover, r) == 0;
+        pthread_attr_destroy(&attr);
+    }
+    if (!started)
+    {
+        free(r);
+        pthread_mutex_lock(&pool->lock);
+        pool->recovering--;
+        pthread_cond_broadcast(&pool->freed);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static engine_t *try_acquire(SM2_pool_t *pool, int prefer)
+{
+    for (int tries = 0; tries < pool->nengines; tries++, prefer = -1)
+    {
+        engine_t *engine;
+
+        pthread_mutex_lock(&pool->lock);
+        engine = claim_engine(pool, prefer);
+        pthread_mutex_unlock(&pool->lock);
+        if (engine == NULL)
+        {
+            return NULL;
+        }
+
+        // free in this process, but another process may be using it
+        if (device_trylock_engine(engine->dev, engine->base_addr) != 0)
+        {
+            unclaim_engine(pool, engine);
+            continue;
+        }
+        if (engine_bring_up(engine) == 0)
+        {
+            return engine;
+        }
+        pool_quarantine(pool, engine);
+    }
+    return NULL;
+}
+
+engine_t *pool_try_acquire(SM2_pool_t *pool)
+{
+    /**
+     * @description: take ownership of a free engine without waiting
+     * @return: engine_t * - owned engine, or NULL if all are busy
+     */
+    return try_acquire(pool, -1);
+}
+
+static engine_t *acquire(SM2_pool_t *pool, int prefer)
+{
+    engine_t *engine = try_acquire(pool, prefer);
+
+    while (engine == NULL)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while ((engine = claim_engine(pool, -1)) == NULL)
+        {
+            if (pool_out_of_service(pool))
+            {
+                pthread_mutex_unlock(&pool->lock);
+                return NULL;
+            }
+            pthread_cond_wait(&pool->freed, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        if (device_lock_engine(engine->dev, engine->base_addr) < 0)
+        {
+            // an unusable lock will not recover, so the engine stays out of service
+            printf("Engine %d of %04x:%02x:%02x.%1x lock failed, taken out of service\n",
+                   ENGINE_INDEX(engine->base_addr), engine->dev->domain, engine->dev->bus,
+                   engine->dev->slot, engine->dev->function);
+            pthread_mutex_lock(&pool->lock);
+            engine->quarantined = 1;
+            engine->ready = 0;
+            pthread_cond_broadcast(&pool->freed);
+            pthread_mutex_unlock(&pool->lock);
+            engine = NULL;
+            continue;
+        }
+        if (engine_bring_up(engine) != 0)
+        {
+            pool_quarantine(pool, engine);
+            engine = NULL;
+        }
+    }
+    return engine;
+}
+
+engine_t *pool_acquire(SM2_pool_t *pool)
+{
+    /**
+     * @description: take ownership of a free engine, waiting if all are busy
+     * @return: engine_t * - owned engine, hand back with pool_release();
+     *          NULL once every engine is quarantined and none is recovering
+     */
+    return acquire(pool, -1);
+}
+
+engine_t *pool_acquire_key(SM2_pool_t *pool, const U32 *key, U32 nwords)
+{
+    /**
+     * @description: as pool_acquire(), but hand out the engine this key
+     *               hashes to whenever it is free, so its DATA window
+     *               usually still holds the key
+     * @param: 
+     *          key - key the operation uploads, NULL for no preference
+     *          nwords - words of key
+     * @return: engine_t * - as pool_acquire()
+     */
+    U32 h = 2166136261u;
+
+    if (key == NULL)
+    {
+        return acquire(pool, -1);
+    }
+    // FNV-1a
+    for (U32 i = 0; i < nwords; i++)
+    {
+        h = (h ^ key[i]) * 16777619u;
+    }
+    return acquire(pool, h % pool->nengines);
+}
+
+void pool_release(SM2_pool_t *pool, engine_t *engine)
+{
+    // must run on the thread that acquired the engine, see device_lock_engine()
+    device_unlock_engine(engine->dev, engine->base_addr);
+    unclaim_engine(pool, engine);
+}
+
+static int job_hung(const SM2_job_t *job)
+{
+    U64 timeout_ns = job->dev->timeout_ns;
+    return timeout_ns != 0 && now_ns() - job->issued_ns > timeout_ns;
+}
+
+/* Uploads item i of a structure-of-arrays request and starts it */
+typedef void (*batch_submit_t)(engine_t *engine, SM2_job_t *job, const void *args, int i);
+
+typedef struct
+{
+    U32 *rand, *pri_key, *pub_key, *hash, *sign, *C1, *S;
+    U32 *self_r, *self_Rx, *self_d, *other_R, *other_P, *UV;
+} batch_args_t;
+
+static void batch_genkey(engine_t *engine, SM2_job_t *job, const void *args, int i)
+{
+    const batch_args_t *a = (const batch_args_t *)args;
+    SM2_GenKeySubmit(engine->dev, engine->base_addr, job,
+                     a->rand + 8 * i, a->pri_key + 8 * i, a->pub_key + 16 * i);
+}
+
+static void batch_sign(engine_t *engine, SM2_job_t *job, const void *args, int i)
+{
+    const batch_args_t *a = (const batch_args_t *)args;
+    SM2_SignSubmit(engine->dev, engine->base_addr, job,
+                   a->rand + 8 * i, a->pri_key + 8 * i, a->hash + 8 * i, a->sign + 16 * i);
+}
+
+static void batch_verify(engine_t *engine, SM2_job_t *job, const void *args, int i)
+{
+    const batch_args_t *a = (const batch_args_t *)args;
+    SM2_VerifySubmit(engine->dev, engine->base_addr, job,
+                     a->pub_key + 16 * i, a->hash + 8 * i, a->sign + 16 * i);
+}
+
+static void batch_encrypt(engine_t *engine, SM2_job_t *job, const void *args, int i)
+{
+    const batch_args_t *a = (const batch_args_t *)args;
+    SM2_EncryptSubmit(engine->dev, engine->base_addr, job,
+                      a->rand + 8 * i, a->pub_key + 16 * i, a->C1 + 16 * i, a->S + 16 * i);
+}
+
+static void batch_decrypt(engine_t *engine, SM2_job_t *job, const void *args, int i)
+{
+    const batch_args_t *a = (const batch_args_t *)args;
+    SM2_DecryptSubmit(engine->dev, engine->base_addr, job,
+                      a->pri_key + 8 * i, a->C1 + 16 * i, a->S + 16 * i);
+}
+
+static void batch_keyx(engine_t *engine, SM2_job_t *job, const void *args, int i)
+{
+    const batch_args_t *a = (const batch_args_t *)args;
+    SM2_KeyExchangeSubmit(engine->dev, engine->base_addr, job,
+                          a->self_r + 8 * i, a->self_Rx + 8 * i, a->self_d + 8 * i,
+                          a->other_R + 16 * i, a->other_P + 16 * i, a->UV + 16 * i);
+}
+
+static void batch_sign_verify(engine_t *engine, SM2_job_t *job, const void *args, int i)
+{
+    // both commands run to completion here, the job only carries the result
+    const batch_args_t *a = (const batch_args_t *)args;
+    job->dev = engine->dev;
+    job->base_addr = engine->base_addr;
+    job->status = SM2_SignVerify(engine->dev, engine->base_addr, a->rand + 8 * i, a->pri_key + 8 * i,
+                                 a->pub_key + 16 * i, a->hash + 8 * i, a->sign + 16 * i);
+}
+
+static int pool_run(SM2_pool_t *pool, batch_submit_t submit, const batch_args_t *args, const U32 *key, U32 nwords)
+{
+    /**
+     * @description: run one operation on any engine; an engine that
+     *               hangs is quarantined and the operation retried on
+     *               another, at most once per engine
+     * @return: int
+     *          check result of the operation
+     *          SM2_TIMEDOUT - no engine completed it
+     */
+    for (int tries = 0; tries < pool->nengines; tries++)
+    {
+        SM2_job_t job;
+        engine_t *engine = pool_acquire_key(pool, key, nwords);
+        int check;
+
+        if (engine == NULL)
+        {
+            break;
+        }
+        submit(engine, &job, args, 0);
+        check = SM2_Wait(&job);
+        if (check != SM2_TIMEDOUT)
+        {
+            pool_release(pool, engine);
+            return check;
+        }
+        pool_quarantine(pool, engine);
+    }
+    return SM2_TIMEDOUT;
+}
+
+int SM2_PoolGenKey(SM2_pool_t *pool, U32 *rand, U32 *pri_key, U32 *pub_key)
+{
+    batch_args_t args = {.rand = rand, .pri_key = pri_key, .pub_key = pub_key};
+    return pool_run(pool, batch_genkey, &args, NULL, 0);
+}
+
+int SM2_PoolSign(SM2_pool_t *pool, U32 *rand, U32 *pri_key, U32 *hash, U32 *sign)
+{
+    batch_args_t args = {.rand = rand, .pri_key = pri_key, .hash = hash, .sign = sign};
+    return pool_run(pool, batch_sign, &args, pri_key, 8);
+}
+
+int SM2_PoolVerify(SM2_pool_t *pool, U32 *pub_key, U32 *hash, U32 *sign)
+{
+    batch_args_t args = {.pub_key = pub_key, .hash = hash, .sign = sign};
+    return pool_run(pool, batch_verify, &args, pub_key, 16);
+}
+
+int SM2_PoolEncrypt(SM2_pool_t *pool, U32 *rand, U32 *pub_key, U32 *C1, U32 *S)
+{
+    batch_args_t args = {.rand = rand, .pub_key = pub_key, .C1 = C1, .S = S};
+    return pool_run(pool, batch_encrypt, &args, pub_key, 16);
+}
+
+int SM2_PoolDecrypt(SM2_pool_t *pool, U32 *pri_key, U32 *C1, U32 *S)
+{
+    batch_args_t args = {.pri_key = pri_key, .C1 = C1, .S = S};
+    return pool_run(pool, batch_decrypt, &args, pri_key, 8);
+}
+
+int SM2_PoolKeyExchange(SM2_pool_t *pool, U32 *self_r, U32 *self_Rx, U32 *self_d,
+                        U32 *other_R, U32 *other_P, U32 *UV)
+{
+    batch_args_t args = {.self_r = self_r, .self_Rx = self_Rx, .self_d = self_d,
+                         .other_R = other_R, .other_P = other_P, .UV = UV};
+    return pool_run(pool, batch_keyx, &args, self_d, 8);
+}
+
+int SM2_PoolSignVerify(SM2_pool_t *pool, U32 *rand, U32 *pri_key, U32 *pub_key, U32 *hash, U32 *sign)
+{
+    batch_args_t args = {.rand = rand, .pri_key = pri_key, .pub_key = pub_key, .hash = hash, .sign = sign};
+    return pool_run(pool, batch_sign_verify, &args, pri_key, 8);
+}
+
+/* ----------------------------------------------------------------
+ * Batch API
+ *
+ * Inputs and outputs are contiguous arrays, item i of a field of w
+ * words at offset i * w. One caller streams the whole batch: it takes
+ * every engine it can get (at least one), keeps a job in flight on
+ * each and refills an engine as soon as its job completes. A job that
+ * outlives the device timeout quarantines its engine and goes back to
+ * the queue for the remaining engines.
+ * ----------------------------------------------------------------
+ */
+static int next_item(int *retry, int *nretry, int *next, int n)
+{
+    if (*nretry > 0)
+    {
+        return retry[--*nretry];
+    }
+    return *next < n ? (*next)++ : -1;
+}
+
+static int run_batch(SM2_pool_t *pool, int n, batch_submit_t submit, const void *args, int *status)
+{
+    engine_t *engines[HSM2_MAX_DEVICES * 2];
+    SM2_job_t jobs[HSM2_MAX_DEVICES * 2];
+    int item[HSM2_MAX_DEVICES * 2];
+    int retry[HSM2_MAX_DEVICES * 2];
+    int nengines = 0, next = 0, done = 0, failed = 0, nretry = 0, hangs = 0;
+
+    if (n <= 0)
+    {
+        return 0;
+    }
+
+    engines[nengines] = pool_acquire(pool);
+    item[nengines++] = -1;
+    while (engines[0] != NULL && nengines < pool->nengines && nengines < n && nengines < HSM2_MAX_DEVICES * 2)
+    {
+        engine_t *engine = pool_try_acquire(pool);
+        if (engine == NULL)
+        {
+            break;
+        }
+        engines[nengines] = engine;
+        item[nengines++] = -1;
+    }
+
+    while (done < n)
+    {
+        int progress = 0, live = 0;
+        for (int e = 0; e < nengines; e++)
+        {
+            if (engines[e] == NULL)
+            {
+                continue;
+            }
+            live++;
+            if (item[e] < 0)
+            {
+                item[e] = next_item(retry, &nretry, &next, n);
+                if (item[e] >= 0)
+                {
+                    submit(engines[e], &jobs[e], args, item[e]);
+                }
+                continue;
+            }
+            int check = SM2_Poll(&jobs[e]);
+            if (check == SM2_PENDING)
+            {
+                if (job_hung(&jobs[e]))
+                {
+                    retry[nretry++] = item[e];
+                    pool_quarantine(pool, engines[e]);
+                    engines[e] = NULL;
+                    hangs++;
+                    progress = 1;
+                }
+                continue;
+            }
+            status[item[e]] = check;
+            failed += check != 0;
+            done++;
+            progress = 1;
+            item[e] = -1;
+        }
+        if (live == 0 && done < n)
+        {
+            // every engine we held hung; wait for one to come back
+            engine_t *engine = hangs <= 2 * pool->nengines ? pool_acquire(pool) : NULL;
+            if (engine == NULL)
+            {
+                for (int i; (i = next_item(retry, &nretry, &next, n)) >= 0;)
+                {
+                    status[i] = SM2_TIMEDOUT;
+                    failed++;
+                    done++;
+                }
+                break;
+            }
+            engines[0] = engine;
+            item[0] = -1;
+            progress = 1;
+        }
+        if (!progress)
+        {
+            // nothing to refill: wait on the oldest job under the device's wait policy
+            int oldest = -1;
+            for (int e = 0; e < nengines; e++)
+            {
+                if (engines[e] != NULL && item[e] >= 0 &&
+                    (oldest < 0 || jobs[e].issued_ns < jobs[oldest].issued_ns))
+                {
+                    oldest = e;
+                }
+            }
+            if (oldest >= 0)
+            {
+                // completes the job for the next SM2_Poll(), or leaves it for job_hung()
+                SM2_Wait(&jobs[oldest]);
+            }
+        }
+    }
+
+    for (int e = 0; e < nengines; e++)
+    {
+        if (engines[e] != NULL)
+        {
+            pool_release(pool, engines[e]);
+        }
+    }
+    return failed;
+}
+
+int SM2_SignBatch(SM2_pool_t *pool, int n, U32 *rand, U32 *pri_key, U32 *hash, U32 *sign, int *status)
+{
+    /**
+     * @description: sign n hashes across all available engines
+     * @param: 
+     *          rand, pri_key, hash - n * 8 words each
+     *          sign - n * 16 words, sign result(r, s) of each item
+     *          status - n check results, as returned by SM2_Sign
+     * @return: int
+     *          number of items with a non-zero status
+     */
+    batch_args_t args = {.rand = rand, .pri_key = pri_key, .hash = hash, .sign = sign};
+    return run_batch(pool, n, batch_sign, &args, status);
+}
 
-    // write start command
-    d32 = CMD_SIGN;
-    addr = base_addr + CMD_ADDR * sizeof(U32);
-    memcpy(dev->addr + addr, &d32, sizeof(U32) * 1);
-    msync((void *)(dev->addr + addr), sizeof(U32) * 1, MS_SYNC | MS_INVALIDATE);
+int SM2_VerifyBatch(SM2_pool_t *pool, int n, U32 *pub_key, U32 *hash, U32 *sign, int *status)
+{
+    /**
+     * @description: verify n signatures across all available engines
+     * @param: 
+     *          pub_key, sign - n * 16 words each
+     *          hash - n * 8 words
+     *          status - n check results, as returned by SM2_Verify
+     * @return: int
+     *          number of items that failed verification
+     */
+    batch_args_t args = {.pub_key = pub_key, .hash = hash, .sign = sign};
+    return run_batch(pool, n, batch_verify, &args, status);
+}
 
-    // Wait for EBUSY signal
-    addr = base_addr + STATE_ADDR * sizeof(U32);
-    d32 = read_le32(dev, addr);
-    while (d32 & 1)
+int SM2_EncryptBatch(SM2_pool_t *pool, int n, U32 *rand, U32 *pub_key, U32 *C1, U32 *S, int *status)
+{
+    /**
+     * @description: encrypt for n public keys across all available engines
+     * @param: 
+     *          rand - n * 8 words
+     *          pub_key, C1, S - n * 16 words each
+     *          status - n check results, as returned by SM2_Encrypt
+     * @return: int
+     *          number of items with a non-zero status
+     */
+    batch_args_t args = {.rand = rand, .pub_key = pub_key, .C1 = C1, .S = S};
+    return run_batch(pool, n, batch_encrypt, &args, status);
+}
+
+/* ----------------------------------------------------------------
+ * Ping-pong pipeline
+ *
+ * A single caller alternates jobs between BASE_ADDR0 and BASE_ADDR1
+ * of one card. Job N+1 is uploaded into the idle engine while job N
+ * computes, and job N is read back while N+1 computes. Results and
+ * status of a job land in the caller's buffers once a later call, or
+ * SM2_PipeDrain(), retires it, so those buffers must stay valid until
+ * then. A job that times out reports SM2_TIMEDOUT and its engine is
+ * re-initialised before it takes another job; if that fails the engine
+ * leaves the pipeline, its sibling takes every later job, and once both
+ * are gone the Pipe calls return -1. The pipeline owns both
+ * engines of the card from SM2_PipeInit() to SM2_PipeClose(), which
+ * must run on the same thread because the engine locks are per thread.
+ * ----------------------------------------------------------------
+ */
+int SM2_PipeInit(SM2_pipe_t *pipe, device_t *dev)
+{
+    /**
+     * @description: take both engines of a card for a pipeline
+     * @return: int
+     *          0 - pipeline ready, close it with SM2_PipeClose()
+     *          -1 - an engine lock failed, neither engine is held
+     */
+    memset(pipe, 0, sizeof(SM2_pipe_t));
+    pipe->dev = dev;
+    if (device_lock_engine(dev, BASE_ADDR0) < 0)
     {
-        d32 = read_le32(dev, addr);
+        return -1;
+    }
+    if (device_lock_engine(dev, BASE_ADDR1) < 0)
+    {
+        device_unlock_engine(dev, BASE_ADDR0);
+        return -1;
     }
-    int check = d32 & 2;
+    return 0;
+}
 
-    // read sign result
-    addr = base_addr + DATA_ADDR * sizeof(U32) + sizeof(U32) * 24;
-    memcpy(sign, dev->addr + addr, sizeof(U32) * 16);
+static int pipe_retire(SM2_pipe_t *pipe, int slot)
+{
+    int check = SM2_Wait(&pipe->jobs[slot]);
+    int ret = 0;
 
-    return check;
+    // the pipeline owns the engine, so a hung one is reset in place
+    if (check == SM2_TIMEDOUT && SM2_Recover(pipe->dev, slot == 0 ? BASE_ADDR0 : BASE_ADDR1) != 0)
+    {
+        printf("Engine %d of %04x:%02x:%02x.%1x taken out of the pipeline\n", slot,
+               pipe->dev->domain, pipe->dev->bus, pipe->dev->slot, pipe->dev->function);
+        pipe->dead[slot] = 1;
+        ret = -1;
+    }
+    if (pipe->status[slot] != NULL)
+    {
+        *pipe->status[slot] = check;
+    }
+    pipe->busy[slot] = 0;
+    return ret;
 }
 
-int SM2_Verify(device_t *dev, U32 base_addr, U32 *pub_key, U32 *hash, U32 *sign)
+static SM2_job_t *pipe_slot(SM2_pipe_t *pipe, int *status, U32 *base_addr)
 {
+    int slot = pipe->next;
 
-    U32 addr, d32;
-    // write pub_key, hash, sign
-    addr = base_addr + DATA_ADDR * sizeof(U32);
-    memcpy(dev->addr + addr, pub_key, sizeof(U32) * 16);                 // public key
-    memcpy(dev->addr + addr + sizeof(U32) * 16, hash, sizeof(U32) * 8);  // hash value
-    memcpy(dev->addr + addr + sizeof(U32) * 24, sign, sizeof(U32) * 16); // signature result
-    msync((void *)(dev->addr + addr), sizeof(U32) * 40, MS_SYNC | MS_INVALIDATE);
+    // the engine taking job N+2 must first hand back job N
+    if (pipe->busy[slot])
+    {
+        pipe_retire(pipe, slot);
+    }
+    // a dead engine's jobs go to its sibling, which retires its own first
+    if (pipe->dead[slot])
+    {
+        slot ^= 1;
+        if (pipe->busy[slot])
+        {
+            pipe_retire(pipe, slot);
+        }
+    }
+    if (pipe->dead[slot])
+    {
+        if (status != NULL)
+        {
+            *status = SM2_TIMEDOUT;
+        }
+        return NULL;
+    }
+    pipe->busy[slot] = 1;
+    pipe->status[slot] = status;
+    pipe->next = slot ^ 1;
+    *base_addr = slot == 0 ? BASE_ADDR0 : BASE_ADDR1;
+    return &pipe->jobs[slot];
+}
 
-    // write start command
-    d32 = CMD_VERIFY;
-    addr = base_addr + CMD_ADDR * sizeof(U32);
-    memcpy(dev->addr + addr, &d32, sizeof(U32) * 1);
-    msync((void *)(dev->addr + addr), sizeof(U32) * 1, MS_SYNC | MS_INVALIDATE);
+int SM2_PipeGenKey(SM2_pipe_t *pipe, U32 *rand, U32 *pri_key, U32 *pub_key, int *status)
+{
+    U32 base_addr;
+    SM2_job_t *job = pipe_slot(pipe, status, &base_addr);
+    if (job == NULL)
+    {
+        return -1;
+    }
+    return SM2_GenKeySubmit(pipe->dev, base_addr, job, rand, pri_key, pub_key);
+}
 
-    // Wait for EBUSY signal
-    addr = base_addr + STATE_ADDR * sizeof(U32);
-    d32 = read_le32(dev, addr);
-    while (d32 & 1)
+int SM2_PipeSign(SM2_pipe_t *pipe, U32 *rand, U32 *pri_key, U32 *hash, U32 *sign, int *status)
+{
+    U32 base_addr;
+    SM2_job_t *job = pipe_slot(pipe, status, &base_addr);
+    if (job == NULL)
     {
-        d32 = read_le32(dev, addr);
+        return -1;
     }
-    int check = d32 & 2;
+    return SM2_SignSubmit(pipe->dev, base_addr, job, rand, pri_key, hash, sign);
+}
 
-    return check;
+int SM2_PipeVerify(SM2_pipe_t *pipe, U32 *pub_key, U32 *hash, U32 *sign, int *status)
+{
+    U32 base_addr;
+    SM2_job_t *job = pipe_slot(pipe, status, &base_addr);
+    if (job == NULL)
+    {
+        return -1;
+    }
+    return SM2_VerifySubmit(pipe->dev, base_addr, job, pub_key, hash, sign);
 }
 
-int SM2_Encrypt(device_t *dev, U32 base_addr, U32 *rand, U32 *pub_key, U32 *C1, U32 *S)
+int SM2_PipeEncrypt(SM2_pipe_t *pipe, U32 *rand, U32 *pub_key, U32 *C1, U32 *S, int *status)
 {
-    U32 addr, d32;
-    // write rand, pub_key
-    addr = base_addr + DATA_ADDR * sizeof(U32);
-    memcpy(dev->addr + addr, rand, sizeof(U32) * 8);                       // random number sequence
-    memcpy(dev->addr + addr + sizeof(U32) * 8, pub_key, sizeof(U32) * 16); // public key
-    msync((void *)(dev->addr + addr), sizeof(U32) * 24, MS_SYNC | MS_INVALIDATE);
+    U32 base_addr;
+    SM2_job_t *job = pipe_slot(pipe, status, &base_addr);
+    if (job == NULL)
+    {
+        return -1;
+    }
+    return SM2_EncryptSubmit(pipe->dev, base_addr, job, rand, pub_key, C1, S);
+}
 
-    // write start command
-    d32 = CMD_ENCRYPT;
-    addr = base_addr + CMD_ADDR * sizeof(U32);
-    memcpy(dev->addr + addr, &d32, sizeof(U32) * 1);
-    msync((void *)(dev->addr + addr), sizeof(U32) * 1, MS_SYNC | MS_INVALIDATE);
+int SM2_PipeDecrypt(SM2_pipe_t *pipe, U32 *pri_key, U32 *C1, U32 *S, int *status)
+{
+    U32 base_addr;
+    SM2_job_t *job = pipe_slot(pipe, status, &base_addr);
+    if (job == NULL)
+    {
+        return -1;
+    }
+    return SM2_DecryptSubmit(pipe->dev, base_addr, job, pri_key, C1, S);
+}
 
-    // Wait for EBUSY signal
-    addr = base_addr + STATE_ADDR * sizeof(U32);
-    d32 = read_le32(dev, addr);
-    while (d32 & 1)
+int SM2_PipeKeyExchange(SM2_pipe_t *pipe, U32 *self_r, U32 *self_Rx, U32 *self_d,
+                        U32 *other_R, U32 *other_P, U32 *UV, int *status)
+{
+    U32 base_addr;
+    SM2_job_t *job = pipe_slot(pipe, status, &base_addr);
+    if (job == NULL)
     {
-        d32 = read_le32(dev, addr);
+        return -1;
+    }
+    return SM2_KeyExchangeSubmit(pipe->dev, base_addr, job, self_r, self_Rx, self_d, other_R, other_P, UV);
+}
+
+int SM2_PipeDrain(SM2_pipe_t *pipe)
+{
+    /**
+     * @description: retire every job still in the pipeline, oldest first
+     * @return: int
+     *          0 - every engine is still in service
+     *          -1 - an engine failed recovery and was taken out of the pipeline
+     */
+    int ret = 0;
+
+    for (int i = 0; i < 2; i++)
+    {
+        int slot = (pipe->next + i) % 2;
+        if (pipe->busy[slot] && pipe_retire(pipe, slot) < 0)
+        {
+            ret = -1;
+        }
     }
-    int check = d32 & 2;
+    return ret;
+}
 
-    // read sign result
-    addr = base_addr + DATA_ADDR * sizeof(U32);
-    memcpy(C1, dev->addr + addr + sizeof(U32) * 24, sizeof(U32) * 16);
-    memcpy(S, dev->addr + addr + sizeof(U32) * 40, sizeof(U32) * 16);
+void SM2_PipeClose(SM2_pipe_t *pipe)
+{
+    SM2_PipeDrain(pipe);
+    device_unlock_engine(pipe->dev, BASE_ADDR1);
+    device_unlock_engine(pipe->dev, BASE_ADDR0);
+}
+
+/* ----------------------------------------------------------------
+ * Submission backends
+ *
+ * SM2_BACKEND_MSYNC copies with memcpy() and follows every block
+ * with msync(), as the library always did. SM2_BACKEND_FENCE uses
+ * plain volatile stores, orders them against the command word with
+ * a store fence and flushes the posted command write by reading
+ * STATE back, so no syscall is made per operation.
+ *
+ * SM2_BACKEND_WC gathers inputs in a 64-byte aligned host staging
+ * buffer and streams them through a second, write-combining mapping
+ * of the BAR (resourceN_wc), so each 64-byte line leaves the CPU as
+ * one burst. CMD_ADDR and STATE_ADDR stay on the uncached mapping.
+ * ----------------------------------------------------------------
+ */
+int device_map_wc(device_t *dev)
+{
+    /**
+     * @description: map the BAR a second time through resourceN_wc
+     * @param: 
+     *          dev - opened device
+     * @return: int
+     *          0 - success
+     *          -1 - BAR not prefetchable or mapping failed
+     */
+    char wcname[110];
+
+    if (dev->wc_addr != NULL)
+    {
+        return 0;
+    }
+
+    snprintf(wcname, sizeof(wcname), "%s_wc", dev->filename);
+    dev->wc_fd = open(wcname, O_RDWR | O_SYNC);
+    if (dev->wc_fd < 0)
+    {
+        printf("Open failed for file '%s': errno %d, %s\n", wcname, errno, strerror(errno));
+        return -1;
+    }
+
+    dev->wc_maddr = (U8 *)mmap(
+        NULL, (size_t)dev->size, PROT_READ | PROT_WRITE, MAP_SHARED, dev->wc_fd, 0);
+    if (dev->wc_maddr == (U8 *)MAP_FAILED)
+    {
+        printf("mmap() of '%s' failed: errno %d, %s\n", wcname, errno, strerror(errno));
+        dev->wc_maddr = NULL;
+        close(dev->wc_fd);
+        return -1;
+    }
 
-    return check;
+    if (posix_memalign((void **)&dev->staging, 64, dev->size) != 0)
+    {
+        munmap(dev->wc_maddr, dev->size);
+        dev->wc_maddr = NULL;
+        close(dev->wc_fd);
+        return -1;
+    }
+    dev->wc_addr = dev->wc_maddr + dev->offset;
+    return 0;
 }
 
-int SM2_Decrypt(device_t *dev, U32 base_addr, U32 *pri_key, U32 *C1, U32 *S)
+int device_set_backend(device_t *dev, int backend)
 {
-    U32 addr, d32;
-    // write pri_key, C1
-    addr = base_addr + DATA_ADDR * sizeof(U32);
-    memcpy(dev->addr + addr, pri_key, sizeof(U32) * 8);                  // private key
-    memcpy(dev->addr + addr + sizeof(U32) * 8, C1, sizeof(U32) * 16); // C1
-    msync((void *)(dev->addr + addr), sizeof(U32) * 24, MS_SYNC | MS_INVALIDATE);
+    if (backend != SM2_BACKEND_MSYNC && backend != SM2_BACKEND_FENCE && backend != SM2_BACKEND_WC)
+    {
+        printf("Unknown submission backend %d\n", backend);
+        return -1;
+    }
+    if (backend == SM2_BACKEND_WC && device_map_wc(dev) < 0)
+    {
+        return -1;
+    }
+    // the WC staging buffer does not hold what other backends wrote
+    if (backend != dev->backend)
+    {
+        shadow_invalidate(dev, BASE_ADDR0);
+        shadow_invalidate(dev, BASE_ADDR1);
+    }
+    dev->backend = backend;
+    return 0;
+}
 
-    // write start command
-    d32 = CMD_DECRYPT;
-    addr = base_addr + CMD_ADDR * sizeof(U32);
-    memcpy(dev->addr + addr, &d32, sizeof(U32) * 1);
-    msync((void *)(dev->addr + addr), sizeof(U32) * 1, MS_SYNC | MS_INVALIDATE);
+static void store_fence(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ __volatile__("sfence" ::: "memory");
+#else
+    __sync_synchronize();
+#endif
+}
 
-    // Wait for EBUSY signal
-    addr = base_addr + STATE_ADDR * sizeof(U32);
-    d32 = read_le32(dev, addr);
-    while (d32 & 1)
+static void sync_range(device_t *dev, U32 addr, U32 len)
+{
+    if (dev->backend == SM2_BACKEND_MSYNC)
     {
-        d32 = read_le32(dev, addr);
+        msync((void *)(dev->addr + addr), len, MS_SYNC | MS_INVALIDATE);
+    }
+}
+
+static void stream_out(U8 *dst, const U8 *src, U32 len)
+{
+    // dst and src are 32-byte aligned, len is a multiple of 32 bytes
+#if defined(__SSE2__)
+    for (U32 i = 0; i < len; i += 16)
+    {
+        _mm_stream_si128((__m128i *)(dst + i), _mm_load_si128((const __m128i *)(src + i)));
     }
-    int check = d32 & 2;
+#else
+    for (U32 i = 0; i < len; i += 8)
+    {
+        *(volatile unsigned long long *)(dst + i) = *(const unsigned long long *)(src + i);
+    }
+#endif
+}
 
-    // read sign result
-    addr = base_addr + DATA_ADDR * sizeof(U32);
-    memcpy(S, dev->addr + addr + sizeof(U32) * 24, sizeof(U32) * 16);
+static void write_block(device_t *dev, U32 addr, const U32 *src, U32 nwords)
+{
+    if (dev->backend == SM2_BACKEND_MSYNC)
+    {
+        memcpy(dev->addr + addr, src, sizeof(U32) * nwords);
+        return;
+    }
+    if (dev->backend == SM2_BACKEND_WC)
+    {
+        // gathered here, streamed out by flush_block()
+        memcpy(dev->staging + addr, src, sizeof(U32) * nwords);
+        return;
+    }
 
-    return check;
+    volatile U32 *dst = (volatile U32 *)(dev->addr + addr);
+    for (U32 i = 0; i < nwords; i++)
+    {
+        dst[i] = src[i];
+    }
 }
 
-int SM2_KeyExchange(device_t *dev, U32 base_addr, U32 *self_r, U32 *self_Rx, U32 *self_d,
-                    U32 *other_R, U32 *other_P, U32 *UV)
+static void flush_block(device_t *dev, U32 addr, U32 len)
 {
-    U32 addr, d32;
-    // write self_r, self_Rx, self_d, other_R, other_P
-    addr = base_addr + DATA_ADDR * sizeof(U32);
-    memcpy(dev->addr + addr, self_r, sizeof(U32) * 8);
-    memcpy(dev->addr + addr + sizeof(U32) * 8, self_Rx, sizeof(U32) * 8);
-    memcpy(dev->addr + addr + sizeof(U32) * 16, self_d, sizeof(U32) * 8);
-    memcpy(dev->addr + addr + sizeof(U32) * 24, other_R, sizeof(U32) * 16);
-    memcpy(dev->addr + addr + sizeof(U32) * 40, other_P, sizeof(U32) * 16);
-    msync((void *)(dev->addr + addr), sizeof(U32) * 56, MS_SYNC | MS_INVALIDATE);
+    if (dev->backend == SM2_BACKEND_WC)
+    {
+        stream_out(dev->wc_addr + addr, dev->staging + addr, len);
+        return;
+    }
+    sync_range(dev, addr, len);
+}
 
-    // write start command
-    d32 = CMD_KEYX;
-    addr = base_addr + CMD_ADDR * sizeof(U32);
-    memcpy(dev->addr + addr, &d32, sizeof(U32) * 1);
-    msync((void *)(dev->addr + addr), sizeof(U32) * 1, MS_SYNC | MS_INVALIDATE);
+static void write_cmd(device_t *dev, U32 base_addr, U32 cmd)
+{
+    U32 addr = base_addr + CMD_ADDR * sizeof(U32);
 
-    // Wait for EBUSY signal
-    addr = base_addr + STATE_ADDR * sizeof(U32);
-    d32 = read_le32(dev, addr);
-    while (d32 & 1)
+    HSM2_PROBE3(cmd_write, cmd, base_addr, dev);
+    if (dev->backend == SM2_BACKEND_MSYNC)
     {
-        d32 = read_le32(dev, addr);
+        memcpy(dev->addr + addr, &cmd, sizeof(U32) * 1);
+        msync((void *)(dev->addr + addr), sizeof(U32) * 1, MS_SYNC | MS_INVALIDATE);
     }
-    int check = d32 & 2;
+    else
+    {
+        // inputs (including WC buffers) must reach the engine before the command word does
+        store_fence();
+        *(volatile U32 *)(dev->addr + addr) = cmd;
+        store_fence();
 
-    // read result
-    addr = base_addr + DATA_ADDR * sizeof(U32);
-    memcpy(UV, dev->addr + addr + sizeof(U32) * 56, sizeof(U32) * 16);
+        // a non-posted read pushes the command write out to the device
+        (void)*(volatile U32 *)(dev->addr + base_addr + STATE_ADDR * sizeof(U32));
+    }
 
-    return check;
+    // a simulated engine goes busy here, as the card does on the write
+    if (dev->sim != NULL)
+    {
+        sim_doorbell(dev, base_addr, cmd);
+    }
+}
+
+/* ----------------------------------------------------------------
+ * MMIO readback
+ *
+ * Every uncached load from the BAR is a full round trip to the card,
+ * so results are fetched with the widest aligned load allowed by
+ * read_width. 64-bit loads are safe on any root complex; 128- and
+ * 256-bit loads are only split into one read request by some, so
+ * they are opt-in through device_set_read_width().
+ * ----------------------------------------------------------------
+ */
+int device_set_read_width(device_t *dev, int width)
+{
+    /**
+     * @description: select the widest load used to read results
+     * @param: 
+     *          width - 4, 8, 16 (needs SSE2) or 32 (needs AVX) bytes
+     * @return: int
+     *          0 - success
+     *          -1 - width not supported by this build
+     */
+    switch (width)
+    {
+    case 4:
+    case 8:
+        break;
+#if defined(__SSE2__)
+    case 16:
+        break;
+#endif
+#if defined(__AVX__)
+    case 32:
+        break;
+#endif
+    default:
+        printf("Unsupported readback width %d\n", width);
+        return -1;
+    }
+    dev->read_width = width;
+    return 0;
+}
+
+static U32 read_block(device_t *dev, U32 addr, U32 *dst, U32 nwords)
+{
+    /**
+     * @description: copy nwords out of the BAR with as few loads as possible
+     * @return: U32 - number of MMIO loads issued
+     */
+    const U8 *src = dev->addr + addr;
+    U8 *out = (U8 *)dst;
+    U32 len = sizeof(U32) * nwords, loads = 0;
+
+    // keep the loads after the STATE read that reported completion
+    __asm__ __volatile__("" ::: "memory");
+    for (U32 i = 0; i < len; loads++)
+    {
+        uintptr_t at = (uintptr_t)(src + i);
+#if defined(__AVX__)
+        if (dev->read_width >= 32 && len - i >= 32 && (at & 31) == 0)
+        {
+            _mm256_storeu_si256((__m256i *)(out + i), _mm256_load_si256((const __m256i *)at));
+            i += 32;
+            continue;
+        }
+#endif
+#if defined(__SSE2__)
+        if (dev->read_width >= 16 && len - i >= 16 && (at & 15) == 0)
+        {
+            _mm_storeu_si128((__m128i *)(out + i), _mm_load_si128((const __m128i *)at));
+            i += 16;
+            continue;
+        }
+#endif
+        if (dev->read_width >= 8 && len - i >= 8 && (at & 7) == 0)
+        {
+            U64 d64 = *(volatile U64 *)at;
+            memcpy(out + i, &d64, 8);
+            i += 8;
+            continue;
+        }
+        U32 d32 = *(volatile U32 *)at;
+        memcpy(out + i, &d32, 4);
+        i += 4;
+    }
+    __asm__ __volatile__("" ::: "memory");
+    return loads;
 }
 
 /* ----------------------------------------------------------------
@@ -573,7 +4816,7 @@ int SM2_KeyExchange(device_t *dev, U32 base_addr, U32 *self_r, U32 *self_Rx, U32
 static void write_8(device_t *dev, U32 addr, U8 data)
 {
     *(volatile U8 *)(dev->addr + addr) = data;
-    msync((void *)(dev->addr + addr), 1, MS_SYNC | MS_INVALIDATE);
+    sync_range(dev, addr, 1);
 }
 
 static U8 read_8(device_t *dev, U32 addr)
@@ -588,7 +4831,7 @@ static void write_le16(device_t *dev, U32 addr, U16 data)
         data = bswap_16(data);
     }
     *(volatile U16 *)(dev->addr + addr) = data;
-    msync((void *)(dev->addr + addr), 2, MS_SYNC | MS_INVALIDATE);
+    sync_range(dev, addr, 2);
 }
 
 static U16 read_le16(device_t *dev, U32 addr)
@@ -608,7 +4851,7 @@ static void write_be16(device_t *dev, U32 addr, U16 data)
         data = bswap_16(data);
     }
     *(volatile U16 *)(dev->addr + addr) = data;
-    msync((void *)(dev->addr + addr), 2, MS_SYNC | MS_INVALIDATE);
+    sync_range(dev, addr, 2);
 }
 
 static U16 read_be16(device_t *dev, U32 addr)
@@ -628,7 +4871,7 @@ static void write_le32(device_t *dev, U32 addr, U32 data)
         data = bswap_32(data);
     }
     *(volatile U32 *)(dev->addr + addr) = data;
-    msync((void *)(dev->addr + addr), 4, MS_SYNC | MS_INVALIDATE);
+    sync_range(dev, addr, 4);
 }
 
 static U32 read_le32(device_t *dev, U32 addr)
@@ -648,7 +4891,7 @@ static void write_be32(device_t *dev, U32 addr, U32 data)
         data = bswap_32(data);
     }
     *(volatile U32 *)(dev->addr + addr) = data;
-    msync((void *)(dev->addr + addr), 4, MS_SYNC | MS_INVALIDATE);
+    sync_range(dev, addr, 4);
 }
 
 static U32 read_be32(device_t *dev, U32 addr)
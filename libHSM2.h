@@ -12,15 +12,44 @@
 #include <sys/mman.h> // #define MAP_FAILED
 #include <sys/types.h>
 #include <sys/stat.h> // fstat()
+#include <sys/file.h> // flock()
 #include <stdlib.h>
 #include <unistd.h>
 #include <byteswap.h>
 #include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <linux/vfio.h>
+#include <sys/syscall.h> // SYS_gettid
+#ifdef HSM2_USDT
+#if defined(__has_include)
+#if !__has_include(<sys/sdt.h>)
+#error "-DHSM2_USDT needs <sys/sdt.h>, install systemtap-sdt-dev(el)"
+#endif
+#endif
+#include <sys/sdt.h> // STAP_PROBEn
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
 /* Readline support */
 // #include <readline/readline.h>
 // #include <readline/history.h>
 
 
+#define HSM2_VENDOR_ID 0x10ee
+#define HSM2_DEVICE_ID 0x7024
+#define HSM2_MAX_DEVICES 16
+
+/* Last-known BDF, overridden by $HSM2_BDF_CACHE; the directory must be root-owned */
+#define HSM2_BDF_CACHE_DIR "/run/hsm2"
+#define HSM2_BDF_CACHE HSM2_BDF_CACHE_DIR "/hsm2.bdf"
+
 #define BASE_ADDR0 0x00000000
 #define BASE_ADDR1 0x00004000
 
@@ -29,6 +58,9 @@
 #define CMD_ADDR 0x00000300
 #define STATE_ADDR 0x00000301
 
+/* Engine number (0, 1) of a base address */
+#define ENGINE_INDEX(base_addr) ((base_addr) == BASE_ADDR0 ? 0 : 1)
+
 #define CMD_SOFTRST 0x55550000
 #define CMD_INIT1 0x00000010
 #define CMD_INIT2 0x00000020
@@ -40,11 +72,213 @@
 #define CMD_DECRYPT 0x0000a801
 #define CMD_KEYX 0x0000cb01
 
+/* Submission backends */
+#define SM2_BACKEND_MSYNC 0 /* memcpy + msync() per block (default) */
+#define SM2_BACKEND_FENCE 1 /* volatile stores + sfence + read-back flush */
+#define SM2_BACKEND_WC 2    /* staged 64-byte bursts through resourceN_wc */
+
+/* Job status while the engine is still computing */
+#define SM2_PENDING (-EBUSY)
 
+/* Engine still busy when its deadline passed */
+#define SM2_TIMEDOUT (-ETIMEDOUT)
+
+/* Signature from the engine failed its own verification */
+#define SM2_BADSIG (-EBADMSG)
+
+/* Default bound on any single completion wait, device_set_timeout() */
+#define SM2_DEFAULT_TIMEOUT_NS 1000000000ULL
+
+
+typedef unsigned long long U64;
 typedef unsigned int U32;
 typedef unsigned short int U16;
 typedef unsigned char U8;
 
+/* HSM2 function found on the bus */
+typedef struct
+{
+	U32 domain;
+	U32 bus;
+	U32 slot;
+	U32 function;
+
+	int irq;
+	int numa_node;
+
+	/* Size of BAR0 in bytes */
+	U32 bar_size;
+} device_info_t;
+
+/* Mode of the /dev/shm segments; the library only maps segments of its own user,
+   -DHSM2_SHM_MODE=0640 lets the owner's group read them, e.g. for hsm2_exporter */
+#ifndef HSM2_SHM_MODE
+#define HSM2_SHM_MODE 0600
+#endif
+
+#define SM2_SHM_MAGIC 0x48534d32 /* "HSM2" */
+#define SM2_SHM_VERSION 3
+
+/* Per-card control block in /dev/shm, shared by every process */
+typedef struct
+{
+	U32 magic;
+	U32 version;
+
+	/* Kernel boot the record belongs to */
+	char boot_id[40];
+
+	/* CRC of the image each engine holds, 0 if unknown */
+	U32 image_crc[2];
+
+	/* Robust process-shared ownership of each engine */
+	pthread_mutex_t engine_lock[2];
+
+	/* device_t token of the last uploader to each engine's DATA window,
+	   0 once an init has overwritten it */
+	U64 data_owner[2];
+} SM2_shm_t;
+
+/* Image file layout, all fields little-endian */
+#define SM2_IMAGE_MAGIC 0x474d4948 /* "HIMG" */
+#define SM2_IMAGE_FORMAT 1
+#define SM2_IMAGE_VERSION 1 /* revision of the built-in image */
+
+#define SM2_IN_CODE_WORDS 512
+#define SM2_EX_CODE_WORDS 256
+#define SM2_DATA_WORDS 512
+
+typedef struct
+{
+	U32 magic;
+	U32 format;
+
+	/* Firmware revision of the image */
+	U32 version;
+
+	/* CRC-32 of in_code, ex_code and data, in that order */
+	U32 crc;
+
+	/* in_code, ex_code, data: byte offset from file start and length */
+	struct
+	{
+		U32 offset;
+		U32 nwords;
+	} section[3];
+} SM2_image_header_t;
+
+/* Image ready for upload, either mapped from a file or built in */
+typedef struct
+{
+	U32 version;
+	U32 crc;
+
+	const U32 *in_code;
+	const U32 *ex_code;
+	const U32 *data;
+
+	/* File mapping, NULL for the built-in image */
+	void *map;
+	size_t map_len;
+} SM2_image_t;
+
+/* Opcode slots for per-opcode bookkeeping */
+#define SM2_OP_GENKEY 0
+#define SM2_OP_SIGN 1
+#define SM2_OP_VERIFY 2
+#define SM2_OP_ENCRYPT 3
+#define SM2_OP_DECRYPT 4
+#define SM2_OP_KEYX 5
+#define SM2_OP_INIT 6
+#define SM2_NUM_OPS 7
+
+/* How a caller waits for the engine to finish */
+typedef struct
+{
+	/* Polls with one PAUSE in between */
+	U32 spin_polls;
+
+	/* Further polls with 2, 4, 8, ... PAUSEs in between */
+	U32 backoff_polls;
+
+	/* Sleep between polls once the above are used up */
+	U32 sleep_ns;
+
+	/* Sleep until shortly before the learned latency of the opcode */
+	int predict;
+
+	/* Sleep on the interrupt eventfd when the device has one; off by
+	   default, switched on once the device is seen to raise it */
+	int use_irq;
+} SM2_wait_policy_t;
+
+#define SM2_STATS_MAGIC 0x54415453 /* "STAT" */
+#define SM2_STATS_VERSION 1
+
+/* HDR latency histogram: 2^3 linear sub-buckets per power of two ns (12.5%), up to ~17 s */
+#define SM2_HIST_SUB_BITS 3
+#define SM2_HIST_BUCKETS 256
+
+/* Counters of one opcode on one engine, only ever added to */
+typedef struct
+{
+	/* Completions seen, and those with the STATE check bit (d32 & 2) set */
+	U64 ops;
+	U64 errors;
+
+	/* Waits that gave up on a busy engine */
+	U64 timeouts;
+
+	/* STATE reads that found the engine busy */
+	U64 polls;
+
+	/* Command write to the first STATE read that found the engine idle,
+	   total and per SM2_HistBucket(); an upper bound of the engine's busy
+	   time that includes the caller's wait granularity (poll interval,
+	   predicted sleep, interrupt wakeup) */
+	U64 busy_ns;
+	U64 hist[SM2_HIST_BUCKETS];
+} SM2_op_stats_t;
+
+/* Per-card statistics in /dev/shm, shared by every process and readable without a lock */
+typedef struct
+{
+	U32 magic;
+	U32 version;
+
+	/* Card the counters belong to, "dddd:bb:ss.f" */
+	char bdf[16];
+
+	SM2_op_stats_t op[2][SM2_NUM_OPS];
+} SM2_stats_t;
+
+/* DATA words any command reads or writes, the span kept in the shadow */
+#define SM2_SHADOW_WORDS 72
+
+/* Host copy of what one engine's DATA window holds */
+typedef struct
+{
+	U32 words[SM2_SHADOW_WORDS];
+	U8 valid[SM2_SHADOW_WORDS];
+
+	/* Words written since the last flush, [dirty_lo, dirty_hi) */
+	U32 dirty_lo;
+	U32 dirty_hi;
+
+	/* Input words sent to the engine, and skipped because it held them */
+	U64 uploaded;
+	U64 skipped;
+} SM2_shadow_t;
+
+/* Longest sleep on the interrupt eventfd before STATE is re-read */
+#define SM2_IRQ_BACKSTOP_MS 1
+
+/* Completions checked for a raised interrupt before use_irq is given up on */
+#define SM2_IRQ_PROBES 16
+
+/* Software model behind a simulated card, see open_device_sim() */
+typedef struct SM2_sim SM2_sim_t;
+
 /* PCI device */
 typedef struct
 {
@@ -57,6 +291,10 @@ typedef struct
 	U32 slot;
 	U32 function;
 
+	/* Interrupt line and NUMA node of the function */
+	int irq;
+	int numa_node;
+
 	/* Resource filename */
 	char filename[100];
 
@@ -73,12 +311,241 @@ typedef struct
 
 	/* Address to pass to read/write (includes offset) */
 	U8 *addr;
+
+	/* Write-combining mapping of the same BAR, NULL until mapped */
+	int wc_fd;
+	U8 *wc_maddr;
+	U8 *wc_addr;
+
+	/* 64-byte aligned host copy of inputs for SM2_BACKEND_WC */
+	U8 *staging;
+
+	/* Submission backend, SM2_BACKEND_* */
+	int backend;
+
+	/* Shared control block, NULL if /dev/shm is unavailable */
+	SM2_shm_t *shm;
+
+	/* Image loaded by SM2_Init(), NULL for the built-in one */
+	const SM2_image_t *image;
+
+	/* VFIO container and group, -1 unless opened with open_device_vfio() */
+	int vfio_container;
+	int vfio_group;
+
+	/* Completion eventfd and the VFIO IRQ index behind it, -1 if none */
+	int irq_fd;
+	int irq_index;
+
+	/* Per-engine eventfds: whoever drains irq_fd passes the wakeup on to
+	   the other engine's waiter through these, -1 if none */
+	int irq_wake[2];
+
+	/* Completions checked for the interrupt so far, and whether it fired;
+	   updated with atomics by any thread */
+	U32 irq_probes;
+	int irq_seen;
+
+	/* Completion wait policy and learned latency per SM2_OP_* */
+	SM2_wait_policy_t wait;
+	U64 latency_ns[SM2_NUM_OPS];
+
+	/* Longest wait for one command before the engine counts as hung, 0 for none */
+	U64 timeout_ns;
+
+	/* Write time of the last CMD_INIT1/CMD_INIT2 per engine, for the statistics */
+	U64 init_issued_ns[2];
+
+	/* Widest MMIO load used for results, in bytes: 4, 8, 16 or 32 */
+	int read_width;
+
+	/* Readback accounting, only kept while readback_stats is set, relaxed atomics */
+	int readback_stats;
+	U64 readback_count;
+	U64 readback_loads;
+	U64 readback_ns;
+
+	/* Skip uploading words an engine already holds, device_set_shadow() */
+	int use_shadow;
+	U64 token;
+	SM2_shadow_t shadow[2];
+
+	/* Software model serving this BAR, NULL for a real card */
+	SM2_sim_t *sim;
+
+	/* Shared statistics, NULL if /dev/shm is unavailable */
+	SM2_stats_t *stats;
 } device_t;
 
+/* Outstanding operation on one engine */
+typedef struct
+{
+	device_t *dev;
+	U32 base_addr;
+	U32 cmd;
+
+	/* SM2_PENDING until the engine reports completion */
+	int status;
+
+	/* Time of the command write, for latency prediction */
+	U64 issued_ns;
+
+	/* Result regions copied out of the DATA window on completion */
+	int nout;
+	U32 out_off[2];
+	U32 out_len[2];
+	U32 *out[2];
+} SM2_job_t;
+
+/* Input fields of a reserved slot, SM2_SlotField() */
+#define SM2_FIELD_RAND 0
+#define SM2_FIELD_PRI_KEY 1
+#define SM2_FIELD_PUB_KEY 2
+#define SM2_FIELD_HASH 3
+#define SM2_FIELD_SIGN 4
+#define SM2_FIELD_C1 5
+#define SM2_FIELD_SELF_R 6
+#define SM2_FIELD_SELF_RX 7
+#define SM2_FIELD_SELF_D 8
+#define SM2_FIELD_OTHER_R 9
+#define SM2_FIELD_OTHER_P 10
+
+/* Inputs of one command, filled in place and started by SM2_Commit() */
+typedef struct
+{
+	device_t *dev;
+	U32 base_addr;
+	U32 cmd;
+
+	/* Engine's DATA window, or its WC staging copy */
+	U32 *window;
+
+	/* Input words the command reads from the start of the window */
+	U32 nwords;
+} SM2_slot_t;
 
+/* Phases recorded in a -DHSM2_TRACE build, see SM2_TraceDump() */
+#define SM2_PHASE_DISCOVER 0   /* BDF lookup in open_device(), arg = cache hit */
+#define SM2_PHASE_MAP 1        /* open and mmap() of the BAR resource */
+#define SM2_PHASE_CONFIG 2     /* BAR address from config space */
+#define SM2_PHASE_SHM 3        /* per-card control block */
+#define SM2_PHASE_INIT_CODE 4  /* soft reset and code upload, SM2_Init() */
+#define SM2_PHASE_INIT_DATA 5  /* data table upload, SM2_Init() */
+#define SM2_PHASE_UPLOAD 6     /* inputs into the DATA window, arg = words */
+#define SM2_PHASE_FLUSH 7      /* msync() or WC burst, arg = bytes */
+#define SM2_PHASE_ISSUE 8      /* CMD_ADDR write, arg = command */
+#define SM2_PHASE_WAIT 9       /* engine busy, arg = STATE polls */
+#define SM2_PHASE_READBACK 10  /* results out of the DATA window, arg = loads */
+#define SM2_NUM_PHASES 11
+
+/* Events kept per thread, the oldest are overwritten */
+#define SM2_TRACE_EVENTS 4096
+
+/*
+ * USDT probes, provider "hsm2", built with -DHSM2_USDT, which fails
+ * the build when <sys/sdt.h> is missing. A probe is a single NOP until
+ * a tracer attaches; without -DHSM2_USDT it is nothing at all.
+ *
+ *   open       (bdf, bar size)               card opened, bdf = domain << 16 | bus << 8 | slot << 3 | function
+ *   init_start (base_addr)                   soft reset and code upload begin
+ *   init_done  (base_addr, status)           image loaded, 0 or SM2_TIMEDOUT
+ *   submit     (cmd, base_addr, job)         a *Submit call or SM2_Commit() starts a job
+ *   cmd_write  (cmd, base_addr, dev)         every CMD_ADDR write, resets and init included
+ *   complete   (cmd, base_addr, status, job) engine done, status = STATE check bit (d32 & 2)
+ *   readback   (cmd, base_addr, loads, job)  results copied out of the DATA window
+ *   timeout    (cmd, base_addr, job)         a wait gave up on a busy engine
+ */
+#define HSM2_BDF(dev) ((dev)->domain << 16 | (dev)->bus << 8 | (dev)->slot << 3 | (dev)->function)
+#ifdef HSM2_USDT
+#define HSM2_PROBE1(name, a) STAP_PROBE1(hsm2, name, a)
+#define HSM2_PROBE2(name, a, b) STAP_PROBE2(hsm2, name, a, b)
+#define HSM2_PROBE3(name, a, b, c) STAP_PROBE3(hsm2, name, a, b, c)
+#define HSM2_PROBE4(name, a, b, c, d) STAP_PROBE4(hsm2, name, a, b, c, d)
+#else
+#define HSM2_PROBE1(name, a)
+#define HSM2_PROBE2(name, a, b)
+#define HSM2_PROBE3(name, a, b, c)
+#define HSM2_PROBE4(name, a, b, c, d)
+#endif
+
+/* One SM2 engine of a card */
+typedef struct
+{
+	device_t *dev;
+	U32 base_addr;
+
+	/* Ownership token, guarded by the pool lock */
+	int busy;
+
+	/* Image loaded, only changed by the owner */
+	int ready;
+
+	/* Hung, held busy until a recovery thread has re-initialised it */
+	int quarantined;
+} engine_t;
+
+/* Ping-pong pipeline over the two engines of one card */
+typedef struct
+{
+	device_t *dev;
+
+	/* Slot 0 runs on BASE_ADDR0, slot 1 on BASE_ADDR1 */
+	SM2_job_t jobs[2];
+	int busy[2];
+	int *status[2];
+
+	/* Engine that failed SM2_Recover(), takes no further jobs */
+	int dead[2];
+
+	/* Slot that takes the next job, also the oldest one in flight */
+	int next;
+} SM2_pipe_t;
+
+/* pool_create() flags */
+#define SM2_POOL_LAZY_INIT 0x1 /* init each engine on its first acquire */
+
+/* Every engine of every opened card */
+typedef struct
+{
+	engine_t *engines;
+	int nengines;
+
+	pthread_mutex_t lock;
+	pthread_cond_t freed;
+
+	/* Round-robin start for the next free engine search */
+	int next;
+
+	/* Recovery threads still running, guarded by lock */
+	int recovering;
+} SM2_pool_t;
+
+
+int enum_devices(device_info_t *infos, int max);
+int enum_devices_sysfs(device_info_t *infos, int max);
 int open_device(device_t **dev);
+int open_device_bdf(const char *bdf, device_t **dev);
+int open_device_at(const device_info_t *info, device_t **dev);
+int open_all_devices(device_t **devs, int max);
+int open_device_vfio(const char *bdf, device_t **dev);
+int device_attach_eventfd(device_t *dev, int fd);
+int open_device_sim(int card, device_t **dev);
+int open_device_sim_peer(device_t *card, device_t **dev);
+void device_sim_set_latency(device_t *dev, int op, U64 ns);
+void device_sim_set_compute(device_t *dev, int enable);
+int device_lock_engine(device_t *dev, U32 base_addr);
+int device_trylock_engine(device_t *dev, U32 base_addr);
+void device_unlock_engine(device_t *dev, U32 base_addr);
 void close_device(device_t *dev);
-void SM2_Init(device_t *dev, U32 base_addr);
+int device_map_wc(device_t *dev);
+int device_set_backend(device_t *dev, int backend);
+int device_set_read_width(device_t *dev, int width);
+void device_set_shadow(device_t *dev, int enable);
+void SM2_WaitPolicyDefault(SM2_wait_policy_t *policy);
+void device_set_wait_policy(device_t *dev, const SM2_wait_policy_t *policy);
+void device_set_timeout(device_t *dev, U64 timeout_ns);
+int SM2_Init(device_t *dev, U32 base_addr);
+int SM2_Recover(device_t *dev, U32 base_addr);
 
 int SM2_GenKey(device_t *dev, U32 base_addr, U32 *rand, U32 *pri_key, U32 *pub_key);
 int SM2_Sign(device_t *dev, U32 base_addr, U32 *rand, U32 *pri_key, U32 *hash, U32 *sign);
@@ -86,6 +553,76 @@ int SM2_Verify(device_t *dev, U32 base_addr, U32 *pub_key, U32 *hash, U32 *sign)
 int SM2_Encrypt(device_t *dev, U32 base_addr, U32 *rand, U32 *pub_key, U32 *C1, U32 *S);
 int SM2_Decrypt(device_t *dev, U32 base_addr, U32 *pri_key, U32 *C1, U32 *S);
 int SM2_KeyExchange(device_t *dev, U32 base_addr, U32 *self_r, U32 *self_Rx, U32 *self_d, U32 *other_R, U32 *other_P, U32 *UV);
+int SM2_SignVerify(device_t *dev, U32 base_addr, U32 *rand, U32 *pri_key, U32 *pub_key, U32 *hash, U32 *sign);
+
+/* Zero-copy API: write inputs straight into the engine, then commit */
+int SM2_Reserve(device_t *dev, U32 base_addr, U32 cmd, SM2_slot_t *slot);
+U32 *SM2_SlotField(const SM2_slot_t *slot, int field, U32 nwords);
+int SM2_Commit(SM2_slot_t *slot, SM2_job_t *job, U32 *out0, U32 *out1);
+
+/* Asynchronous API: submit returns after the command write */
+int SM2_GenKeySubmit(device_t *dev, U32 base_addr, SM2_job_t *job, U32 *rand, U32 *pri_key, U32 *pub_key);
+int SM2_SignSubmit(device_t *dev, U32 base_addr, SM2_job_t *job, U32 *rand, U32 *pri_key, U32 *hash, U32 *sign);
+int SM2_VerifySubmit(device_t *dev, U32 base_addr, SM2_job_t *job, U32 *pub_key, U32 *hash, U32 *sign);
+int SM2_EncryptSubmit(device_t *dev, U32 base_addr, SM2_job_t *job, U32 *rand, U32 *pub_key, U32 *C1, U32 *S);
+int SM2_DecryptSubmit(device_t *dev, U32 base_addr, SM2_job_t *job, U32 *pri_key, U32 *C1, U32 *S);
+int SM2_KeyExchangeSubmit(device_t *dev, U32 base_addr, SM2_job_t *job, U32 *self_r, U32 *self_Rx, U32 *self_d, U32 *other_R, U32 *other_P, U32 *UV);
+int SM2_Poll(SM2_job_t *job);
+int SM2_Wait(SM2_job_t *job);
+int SM2_WaitDeadline(SM2_job_t *job, U64 deadline_ns);
+U64 SM2_Deadline(U64 timeout_ns);
+
+int SM2_InitWarm(device_t *dev, U32 base_addr);
+int SM2_InitWarmOwned(device_t *dev, U32 base_addr);
+int SM2_InitEngines(engine_t *engines, int n);
+
+/* Firmware images */
+const SM2_image_t *SM2_ImageDefault(void);
+int SM2_ImageLoad(const char *path, SM2_image_t *img);
+void SM2_ImageUnload(SM2_image_t *img);
+int SM2_ImageWrite(const char *path, const SM2_image_t *img);
+void SM2_SetImage(device_t *dev, const SM2_image_t *img);
+
+/* Phase trace as Chrome/Perfetto JSON, -1 unless built with -DHSM2_TRACE */
+int SM2_TraceDump(const char *path);
+
+/* Shared statistics, for monitoring tools */
+SM2_stats_t *SM2_StatsMap(const char *name);
+void SM2_StatsUnmap(SM2_stats_t *stats);
+int SM2_HistBucket(U64 ns);
+U64 SM2_HistLower(int bucket);
+
+/* Thread-safe engine pool */
+int pool_create(SM2_pool_t **pool, device_t **devs, int ndev, int flags);
+void pool_destroy(SM2_pool_t *pool);
+engine_t *pool_acquire(SM2_pool_t *pool);
+engine_t *pool_try_acquire(SM2_pool_t *pool);
+engine_t *pool_acquire_key(SM2_pool_t *pool, const U32 *key, U32 nwords);
+void pool_release(SM2_pool_t *pool, engine_t *engine);
+
+int SM2_PoolGenKey(SM2_pool_t *pool, U32 *rand, U32 *pri_key, U32 *pub_key);
+int SM2_PoolSign(SM2_pool_t *pool, U32 *rand, U32 *pri_key, U32 *hash, U32 *sign);
+int SM2_PoolVerify(SM2_pool_t *pool, U32 *pub_key, U32 *hash, U32 *sign);
+int SM2_PoolEncrypt(SM2_pool_t *pool, U32 *rand, U32 *pub_key, U32 *C1, U32 *S);
+int SM2_PoolDecrypt(SM2_pool_t *pool, U32 *pri_key, U32 *C1, U32 *S);
+int SM2_PoolKeyExchange(SM2_pool_t *pool, U32 *self_r, U32 *self_Rx, U32 *self_d, U32 *other_R, U32 *other_P, U32 *UV);
+int SM2_PoolSignVerify(SM2_pool_t *pool, U32 *rand, U32 *pri_key, U32 *pub_key, U32 *hash, U32 *sign);
+
+/* Ping-pong pipeline: results and *status are written when a job retires */
+int SM2_PipeInit(SM2_pipe_t *pipe, device_t *dev);
+int SM2_PipeGenKey(SM2_pipe_t *pipe, U32 *rand, U32 *pri_key, U32 *pub_key, int *status);
+int SM2_PipeSign(SM2_pipe_t *pipe, U32 *rand, U32 *pri_key, U32 *hash, U32 *sign, int *status);
+int SM2_PipeVerify(SM2_pipe_t *pipe, U32 *pub_key, U32 *hash, U32 *sign, int *status);
+int SM2_PipeEncrypt(SM2_pipe_t *pipe, U32 *rand, U32 *pub_key, U32 *C1, U32 *S, int *status);
+int SM2_PipeDecrypt(SM2_pipe_t *pipe, U32 *pri_key, U32 *C1, U32 *S, int *status);
+int SM2_PipeKeyExchange(SM2_pipe_t *pipe, U32 *self_r, U32 *self_Rx, U32 *self_d, U32 *other_R, U32 *other_P, U32 *UV, int *status);
+int SM2_PipeDrain(SM2_pipe_t *pipe);
+void SM2_PipeClose(SM2_pipe_t *pipe);
+
+/* Batch API: structure-of-arrays inputs streamed through the pool */
+int SM2_SignBatch(SM2_pool_t *pool, int n, U32 *rand, U32 *pri_key, U32 *hash, U32 *sign, int *status);
+int SM2_VerifyBatch(SM2_pool_t *pool, int n, U32 *pub_key, U32 *hash, U32 *sign, int *status);
+int SM2_EncryptBatch(SM2_pool_t *pool, int n, U32 *rand, U32 *pub_key, U32 *C1, U32 *S, int *status);
 
 
 /* Low-level access functions */
@@ -0,0 +1,419 @@
+/*
+ * @Description: latency and bandwidth of BAR reads and writes for each access width, mapping and flush strategy
+ * @FilePath: /HSM2_PCIE/mmio_bench.c
+ *
+ * usage: mmio_bench [iterations] [engine 0|1] [report.json]
+ *
+ * Works on the DATA window of one engine, which holds only command
+ * inputs and results once the engine is initialised; the engine is
+ * locked for the whole run. Rows named after a backend reproduce the
+ * accesses that backend makes, so the summary names the fastest
+ * SM2_BACKEND_* for this host. The 256-bit rows are built for AVX
+ * whatever the compiler flags and run only on a CPU that has it.
+ */
+#include "libHSM2.h"
+#include <sys/utsname.h>
+
+/* Inputs of the largest command, rounded to whole 32-byte bursts */
+#define BLOCK_BYTES 256
+
+#define FLUSH_NONE 0     /* posted stores only */
+#define FLUSH_SFENCE 1   /* store fence */
+#define FLUSH_READBACK 2 /* store fence + STATE read, as SM2_BACKEND_FENCE/WC */
+#define FLUSH_MSYNC 3    /* msync() of the block, as SM2_BACKEND_MSYNC */
+
+/* store_block() widths besides the plain ones */
+#define WIDTH_MEMCPY 0
+#define WIDTH_STREAM16 -16
+#define WIDTH_STREAM32 -32
+
+typedef struct
+{
+    const char *test;
+    const char *map;
+    int width;
+    const char *flush;
+    double ns;
+    double mb_per_sec;
+} row_t;
+
+static const char *flush_names[] = {"none", "sfence", "readback", "msync"};
+
+static row_t rows[256];
+static int nrows;
+static volatile U64 sink;
+
+static U64 now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (U64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // AVX intrinsics, usable in target("avx") functions without -mavx
+#define HAVE_AVX_ROWS 1
+
+__attribute__((target("avx"))) static U32 load_256(const U8 *src)
+{
+    return _mm256_extract_epi32(_mm256_load_si256((const __m256i *)src), 0);
+}
+
+__attribute__((target("avx"))) static void store_256(U8 *dst, const U8 *src, int stream)
+{
+    __m256i v = _mm256_load_si256((const __m256i *)src);
+    if (stream)
+    {
+        _mm256_stream_si256((__m256i *)dst, v);
+    }
+    else
+    {
+        _mm256_store_si256((__m256i *)dst, v);
+    }
+}
+#endif
+
+static const char *width_name(int width)
+{
+    static char buf[16];
+
+    switch (width)
+    {
+    case WIDTH_MEMCPY:
+        return "memcpy";
+    case WIDTH_STREAM16:
+        return "nt128";
+    case WIDTH_STREAM32:
+        return "nt256";
+    default:
+        snprintf(buf, sizeof(buf), "%d", width * 8);
+        return buf;
+    }
+}
+
+static int width_supported(int width)
+{
+    switch (width)
+    {
+#if defined(__SSE2__)
+    case 16:
+    case WIDTH_STREAM16:
+        return 1;
+#endif
+#if defined(HAVE_AVX_ROWS)
+    case 32:
+    case WIDTH_STREAM32:
+        return __builtin_cpu_supports("avx");
+#endif
+    case WIDTH_MEMCPY:
+    case 1:
+    case 2:
+    case 4:
+    case 8:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static void load_block(const U8 *src, U32 len, int width)
+{
+    U64 acc = 0;
+
+    for (U32 i = 0; i < len; i += width)
+    {
+        switch (width)
+        {
+        case 1:
+            acc += *(volatile U8 *)(src + i);
+            break;
+        case 2:
+            acc += *(volatile U16 *)(src + i);
+            break;
+        case 4:
+            acc += *(volatile U32 *)(src + i);
+            break;
+#if defined(__SSE2__)
+        case 16:
+            acc += _mm_cvtsi128_si32(_mm_load_si128((const __m128i *)(src + i)));
+            break;
+#endif
+#if defined(HAVE_AVX_ROWS)
+        case 32:
+            acc += load_256(src + i);
+            break;
+#endif
+        default:
+            acc += *(volatile U64 *)(src + i);
+            break;
+        }
+        // one MMIO load per access, none hoisted out of the loop
+        __asm__ __volatile__("" ::: "memory");
+    }
+    sink = acc;
+}
+
+static void store_block(U8 *dst, const U8 *src, U32 len, int width)
+{
+    if (width == WIDTH_MEMCPY)
+    {
+        memcpy(dst, src, len);
+        return;
+    }
+    for (U32 i = 0; i < len; i += (width < 0 ? -width : width))
+    {
+        switch (width)
+        {
+        case 1:
+            *(volatile U8 *)(dst + i) = src[i];
+            break;
+        case 2:
+            *(volatile U16 *)(dst + i) = *(const U16 *)(src + i);
+            break;
+        case 4:
+            *(volatile U32 *)(dst + i) = *(const U32 *)(src + i);
+            break;
+#if defined(__SSE2__)
+        case 16:
+            _mm_store_si128((__m128i *)(dst + i), _mm_load_si128((const __m128i *)(src + i)));
+            break;
+        case WIDTH_STREAM16:
+            _mm_stream_si128((__m128i *)(dst + i), _mm_load_si128((const __m128i *)(src + i)));
+            break;
+#endif
+#if defined(HAVE_AVX_ROWS)
+        case 32:
+        case WIDTH_STREAM32:
+            store_256(dst + i, src + i, width == WIDTH_STREAM32);
+            break;
+#endif
+        default:
+            *(volatile U64 *)(dst + i) = *(const U64 *)(src + i);
+            break;
+        }
+        __asm__ __volatile__("" ::: "memory");
+    }
+}
+
+static void flush(device_t *dev, U32 base_addr, U8 *dst, int how)
+{
+    switch (how)
+    {
+    case FLUSH_SFENCE:
+    case FLUSH_READBACK:
+#if defined(__x86_64__) || defined(__i386__)
+        __asm__ __volatile__("sfence" ::: "memory");
+#else
+        __sync_synchronize();
+#endif
+        if (how == FLUSH_READBACK)
+        {
+            // a non-posted read pushes the posted writes out to the device
+            sink = *(volatile U32 *)(dev->addr + base_addr + STATE_ADDR * sizeof(U32));
+        }
+        break;
+    case FLUSH_MSYNC:
+        msync((void *)((uintptr_t)dst & ~(uintptr_t)(getpagesize() - 1)),
+              BLOCK_BYTES + ((uintptr_t)dst & (getpagesize() - 1)), MS_SYNC | MS_INVALIDATE);
+        break;
+    default:
+        break;
+    }
+}
+
+static void add_row(const char *test, const char *map, int width, int how, U64 ns, int iterations, U32 bytes)
+{
+    row_t *r = &rows[nrows++];
+
+    r->test = test;
+    r->map = map;
+    r->width = width;
+    r->flush = how < 0 ? "-" : flush_names[how];
+    r->ns = (double)ns / iterations;
+    r->mb_per_sec = bytes * (double)iterations / (ns * 1e-9) / 1e6;
+    printf("%-8s %-4s %-7s %-9s %12.1f %12.1f\n",
+           r->test, r->map, width_name(width), r->flush, r->ns, r->mb_per_sec);
+}
+
+static void bench_reads(U8 *window, const char *map, int iterations)
+{
+    const int widths[] = {1, 2, 4, 8, 16, 32};
+
+    for (int w = 0; w < 6; w++)
+    {
+        if (!width_supported(widths[w]))
+        {
+            printf("%-8s %-4s %-7s %-9s unavailable on this CPU\n", "read", map, width_name(widths[w]), "-");
+            continue;
+        }
+        U64 t0 = now_ns();
+        for (int i = 0; i < iterations; i++)
+        {
+            load_block(window, widths[w], widths[w]);
+        }
+        add_row("read", map, widths[w], -1, now_ns() - t0, iterations, widths[w]);
+
+        t0 = now_ns();
+        for (int i = 0; i < iterations; i++)
+        {
+            load_block(window, BLOCK_BYTES, widths[w]);
+        }
+        add_row("readblk", map, widths[w], -1, now_ns() - t0, iterations, BLOCK_BYTES);
+    }
+}
+
+static void bench_writes(device_t *dev, U32 base_addr, U8 *window, const U8 *src, const char *map, int iterations)
+{
+    const int widths[] = {WIDTH_MEMCPY, 1, 2, 4, 8, 16, 32, WIDTH_STREAM16, WIDTH_STREAM32};
+
+    for (int w = 0; w < 9; w++)
+    {
+        if (!width_supported(widths[w]))
+        {
+            printf("%-8s %-4s %-7s %-9s unavailable on this CPU\n", "write", map, width_name(widths[w]), "-");
+            continue;
+        }
+        for (int how = FLUSH_NONE; how <= FLUSH_MSYNC; how++)
+        {
+            U64 t0 = now_ns();
+            for (int i = 0; i < iterations; i++)
+            {
+                store_block(window, src, BLOCK_BYTES, widths[w]);
+                flush(dev, base_addr, window, how);
+            }
+            add_row("write", map, widths[w], how, now_ns() - t0, iterations, BLOCK_BYTES);
+        }
+    }
+}
+
+static double find_ns(const char *test, const char *map, int width, int how)
+{
+    for (int i = 0; i < nrows; i++)
+    {
+        if (strcmp(rows[i].test, test) == 0 && strcmp(rows[i].map, map) == 0 &&
+            rows[i].width == width && strcmp(rows[i].flush, flush_names[how]) == 0)
+        {
+            return rows[i].ns;
+        }
+    }
+    return 0;
+}
+
+static void write_report(const char *path, const struct utsname *host, device_t *dev, const char *best)
+{
+    FILE *fp = fopen(path, "w");
+
+    if (fp == NULL)
+    {
+        printf("Cannot write %s: %s\n", path, strerror(errno));
+        return;
+    }
+    fprintf(fp, "{\n  \"host\": \"%s\",\n  \"kernel\": \"%s\",\n  \"device\": \"%s\",\n  \"time\": %ld,\n",
+            host->nodename, host->release, dev->filename, (long)time(NULL));
+    fprintf(fp, "  \"best_backend\": \"%s\",\n  \"results\": [\n", best);
+    for (int i = 0; i < nrows; i++)
+    {
+        fprintf(fp, "    {\"test\": \"%s\", \"map\": \"%s\", \"width\": \"%s\", \"flush\": \"%s\", "
+                    "\"ns\": %.1f, \"mb_per_sec\": %.1f}%s\n",
+                rows[i].test, rows[i].map, width_name(rows[i].width), rows[i].flush,
+                rows[i].ns, rows[i].mb_per_sec, i + 1 < nrows ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 10000;
+    U32 base_addr = (argc > 2 && atoi(argv[2]) == 0) ? BASE_ADDR0 : BASE_ADDR1;
+    const char *report = argc > 3 ? argv[3] : NULL;
+    const char *names[] = {"msync", "fence", "wc"};
+    double backend_ns[3];
+    int best = -1;
+    struct utsname host;
+    U8 *src;
+
+    device_t *dev;
+    if (open_device(&dev) < 0)
+    {
+        return 1;
+    }
+    // take the engine before the image check, so no other process is mid-command
+    if (device_lock_engine(dev, base_addr) < 0)
+    {
+        close_device(dev);
+        return 1;
+    }
+    if (SM2_InitWarmOwned(dev, base_addr) < 0)
+    {
+        device_unlock_engine(dev, base_addr);
+        close_device(dev);
+        return 1;
+    }
+    if (posix_memalign((void **)&src, 64, BLOCK_BYTES) != 0)
+    {
+        device_unlock_engine(dev, base_addr);
+        close_device(dev);
+        return 1;
+    }
+    for (int i = 0; i < BLOCK_BYTES; i++)
+    {
+        src[i] = (U8)i;
+    }
+
+    uname(&host);
+    printf("host %s, kernel %s, device %s, %d iterations\n\n",
+           host.nodename, host.release, dev->filename, iterations);
+    printf("%-8s %-4s %-7s %-9s %12s %12s\n", "test", "map", "width", "flush", "ns/access", "MB/s");
+
+    U8 *uc = dev->addr + base_addr + DATA_ADDR * sizeof(U32);
+    bench_reads(uc, "uc", iterations);
+    bench_writes(dev, base_addr, uc, src, "uc", iterations);
+
+    U8 *wc = NULL;
+    if (device_map_wc(dev) == 0)
+    {
+        wc = dev->wc_addr + base_addr + DATA_ADDR * sizeof(U32);
+        bench_reads(wc, "wc", iterations);
+        bench_writes(dev, base_addr, wc, src, "wc", iterations);
+    }
+    else
+    {
+        printf("wc mapping unavailable\n");
+    }
+
+    // the accesses each backend makes for one command's inputs
+    backend_ns[SM2_BACKEND_MSYNC] = find_ns("write", "uc", WIDTH_MEMCPY, FLUSH_MSYNC);
+    backend_ns[SM2_BACKEND_FENCE] = find_ns("write", "uc", 4, FLUSH_READBACK);
+    backend_ns[SM2_BACKEND_WC] = wc != NULL ? find_ns("write", "wc", WIDTH_STREAM16, FLUSH_READBACK) : 0;
+    printf("\n");
+    for (int i = 0; i < 3; i++)
+    {
+        if (backend_ns[i] <= 0)
+        {
+            printf("backend %-6s unavailable\n", names[i]);
+            continue;
+        }
+        printf("backend %-6s %10.1f ns per %d-byte upload\n", names[i], backend_ns[i], BLOCK_BYTES);
+        if (best < 0 || backend_ns[i] < backend_ns[best])
+        {
+            best = i;
+        }
+    }
+    printf("fastest backend on this host: %s\n", names[best]);
+
+    if (report != NULL)
+    {
+        write_report(report, &host, dev, names[best]);
+    }
+
+    // the window no longer holds what any process's shadow expects
+    if (dev->shm != NULL)
+    {
+        dev->shm->data_owner[ENGINE_INDEX(base_addr)] = 0;
+    }
+    device_unlock_engine(dev, base_addr);
+    free(src);
+    close_device(dev);
+    return 0;
+}
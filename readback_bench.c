@@ -0,0 +1,89 @@
+/*
+ * @Description: MMIO round trips and time spent reading results back, per opcode and load width
+ * @FilePath: /HSM2_PCIE/readback_bench.c
+ *
+ * usage: readback_bench [iterations] [engine 0|1]
+ */
+#include "libHSM2.h"
+
+typedef struct
+{
+    U32 rand[8], pri_key[8], pub_key[16], hash[8], sign[16];
+    U32 C1[16], S[16], Rx[8], UV[16];
+} vectors_t;
+
+static int run_op(device_t *dev, U32 base_addr, int op, vectors_t *v)
+{
+    switch (op)
+    {
+    case SM2_OP_GENKEY:
+        return SM2_GenKey(dev, base_addr, v->rand, v->pri_key, v->pub_key);
+    case SM2_OP_SIGN:
+        return SM2_Sign(dev, base_addr, v->rand, v->pri_key, v->hash, v->sign);
+    case SM2_OP_VERIFY:
+        return SM2_Verify(dev, base_addr, v->pub_key, v->hash, v->sign);
+    case SM2_OP_ENCRYPT:
+        return SM2_Encrypt(dev, base_addr, v->rand, v->pub_key, v->C1, v->S);
+    case SM2_OP_DECRYPT:
+        return SM2_Decrypt(dev, base_addr, v->pri_key, v->C1, v->S);
+    default:
+        return SM2_KeyExchange(dev, base_addr, v->rand, v->Rx, v->pri_key, v->pub_key, v->pub_key, v->UV);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *names[] = {"genkey", "sign", "verify", "encrypt", "decrypt", "keyx"};
+    const int widths[] = {4, 8, 16, 32};
+    int iterations = argc > 1 ? atoi(argv[1]) : 10000;
+    U32 base_addr = (argc > 2 && atoi(argv[2]) == 0) ? BASE_ADDR0 : BASE_ADDR1;
+    vectors_t v;
+
+    device_t *dev;
+    if (open_device(&dev) < 0)
+    {
+        return 1;
+    }
+    SM2_Init(dev, base_addr);
+    device_set_backend(dev, SM2_BACKEND_FENCE);
+
+    // one key pair, signature and ciphertext that the later ops consume
+    memset(&v, 0, sizeof(v));
+    for (int i = 0; i < 8; i++)
+    {
+        v.rand[i] = 0x12345678;
+        v.hash[i] = 0x9abcdef0 + i;
+        v.Rx[i] = 0x0f0f0f0f;
+    }
+    run_op(dev, base_addr, SM2_OP_GENKEY, &v);
+    run_op(dev, base_addr, SM2_OP_SIGN, &v);
+    run_op(dev, base_addr, SM2_OP_ENCRYPT, &v);
+
+    printf("%-8s %6s %14s %14s\n", "op", "width", "loads/op", "ns/readback");
+    for (int w = 0; w < 4; w++)
+    {
+        if (device_set_read_width(dev, widths[w]) < 0)
+        {
+            continue;
+        }
+        for (int op = SM2_OP_GENKEY; op <= SM2_OP_KEYX; op++)
+        {
+            vectors_t scratch = v;
+
+            dev->readback_stats = 1;
+            dev->readback_count = dev->readback_loads = dev->readback_ns = 0;
+            for (int i = 0; i < iterations; i++)
+            {
+                run_op(dev, base_addr, op, &scratch);
+            }
+            dev->readback_stats = 0;
+
+            printf("%-8s %6d %14.2f %14.1f\n", names[op], widths[w],
+                   (double)dev->readback_loads / dev->readback_count,
+                   (double)dev->readback_ns / dev->readback_count);
+        }
+    }
+
+    close_device(dev);
+    return 0;
+}
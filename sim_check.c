@@ -0,0 +1,144 @@
+/*
+ * @Description: round trip of every SM2 command through a simulated card, exits non-zero on a mismatch
+ * @FilePath: /HSM2_PCIE/sim_check.c
+ *
+ * usage: sim_check
+ *
+ * Needs no hardware: the card is the software model of
+ * open_device_sim(), which does the curve math, so this checks the
+ * library's upload and readback paths end to end.
+ */
+#include "libHSM2.h"
+
+static int failures;
+
+static void check(const char *what, int ok)
+{
+    printf("%-46s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+    {
+        failures++;
+    }
+}
+
+int main(void)
+{
+    U32 rand[8] = {0x12345678, 0x9abcdef0, 0x0fedcba9, 0x87654321, 0x13579bdf, 0x2468ace0, 0x0badcafe, 0x5eed5eed};
+    U32 hash[8] = {0xfd93ea51, 0x6080a881, 0x1b3a16ff, 0x5f465ff7, 0x2a1c94b6, 0xa55f6fa5, 0xcb7bd2b2, 0x501023c6};
+    U32 pri_key[8], pub_key[16], sign[16], bad[16], C1[16], S[16], S2[16];
+    volatile U32 *window;
+    device_t *dev, *peer;
+    SM2_pool_t *pool;
+    engine_t *first, *again;
+    SM2_job_t job;
+    U64 skipped;
+    U64 events;
+    struct timespec start, end;
+
+    if (open_device_sim(0, &dev) < 0)
+    {
+        return 1;
+    }
+    if (SM2_Init(dev, BASE_ADDR0) != 0)
+    {
+        close_device(dev);
+        return 1;
+    }
+
+    // genkey -> sign -> verify
+    check("genkey", SM2_GenKey(dev, BASE_ADDR0, rand, pri_key, pub_key) == 0);
+    check("sign", SM2_Sign(dev, BASE_ADDR0, rand, pri_key, hash, sign) == 0);
+    check("verify", SM2_Verify(dev, BASE_ADDR0, pub_key, hash, sign) == 0);
+    memcpy(bad, sign, sizeof(bad));
+    bad[15] ^= 1;
+    check("verify rejects a flipped bit", SM2_Verify(dev, BASE_ADDR0, pub_key, hash, bad) != 0);
+    check("sign with self-verify", SM2_SignVerify(dev, BASE_ADDR0, rand, pri_key, pub_key, hash, sign) == 0);
+
+    // encrypt -> decrypt gives back the shared point
+    check("encrypt", SM2_Encrypt(dev, BASE_ADDR0, rand, pub_key, C1, S) == 0);
+    check("decrypt", SM2_Decrypt(dev, BASE_ADDR0, pri_key, C1, S2) == 0);
+    check("decrypt matches encrypt", memcmp(S, S2, sizeof(S)) == 0);
+
+    // a soft reset cancels a command the engine already took
+    device_sim_set_latency(dev, SM2_OP_SIGN, 20000000);
+    SM2_SignSubmit(dev, BASE_ADDR0, &job, rand, pri_key, hash, sign);
+    usleep(5000); // let the engine thread take it
+    window = (volatile U32 *)(dev->addr + BASE_ADDR0 + DATA_ADDR * sizeof(U32));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    check("init during a command", SM2_Init(dev, BASE_ADDR0) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    check("init does not wait for the cancelled command",
+          (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec) < 10000000);
+    for (int i = 0; i < 16; i++)
+    {
+        window[24 + i] = 0;
+    }
+    while (read(dev->irq_fd, &events, sizeof(events)) == sizeof(events))
+    {
+        // drop the completions of the init commands
+    }
+    usleep(40000);
+    int untouched = read(dev->irq_fd, &events, sizeof(events)) < 0;
+    for (int i = 0; i < 16; i++)
+    {
+        untouched &= window[24 + i] == 0;
+    }
+    check("cancelled command writes nothing back", untouched);
+    device_sim_set_latency(dev, SM2_OP_SIGN, 70000);
+    check("sign after reset", SM2_Sign(dev, BASE_ADDR0, rand, pri_key, hash, sign) == 0 &&
+                                  SM2_Verify(dev, BASE_ADDR0, pub_key, hash, sign) == 0);
+
+    // a repeated sign with the shadow on skips the words the engine holds
+    device_set_shadow(dev, 1);
+    SM2_Sign(dev, BASE_ADDR0, rand, pri_key, hash, sign);
+    skipped = dev->shadow[0].skipped;
+    check("shadowed sign", SM2_Sign(dev, BASE_ADDR0, rand, pri_key, hash, sign) == 0 &&
+                               SM2_Verify(dev, BASE_ADDR0, pub_key, hash, sign) == 0);
+    check("shadowed sign skips held words", dev->shadow[0].skipped > skipped);
+
+    // a re-init from another device_t overwrites the DATA window behind the shadow
+    if (open_device_sim_peer(dev, &peer) == 0)
+    {
+        check("sign through a peer", SM2_Sign(peer, BASE_ADDR0, rand, pri_key, hash, sign) == 0 &&
+                                         SM2_Verify(peer, BASE_ADDR0, pub_key, hash, sign) == 0);
+        SM2_Sign(dev, BASE_ADDR0, rand, pri_key, hash, sign);
+        check("init from a peer", SM2_Init(peer, BASE_ADDR0) == 0);
+        memset(sign, 0, sizeof(sign));
+        check("shadowed sign after a peer's init", SM2_Sign(dev, BASE_ADDR0, rand, pri_key, hash, sign) == 0 &&
+                                                       SM2_Verify(peer, BASE_ADDR0, pub_key, hash, sign) == 0);
+        close_device(peer);
+    }
+    else
+    {
+        check("open a peer", 0);
+    }
+    device_set_shadow(dev, 0);
+
+    // a key keeps landing on the engine it hashes to while that one is free
+    if (pool_create(&pool, &dev, 1, 0) == 0)
+    {
+        first = pool_acquire_key(pool, pri_key, 8);
+        pool_release(pool, first);
+        again = pool_acquire_key(pool, pri_key, 8);
+        check("key routed to the same engine", first == again);
+        pool_release(pool, again);
+        pri_key[0] ^= 1;
+        for (int i = 0; i < 16 && again == first; i++)
+        {
+            // some other key hashes to the other engine
+            again = pool_acquire_key(pool, pri_key, 8);
+            pool_release(pool, again);
+            pri_key[0] += 2;
+        }
+        check("keys spread over both engines", again != first);
+        pool_destroy(pool);
+    }
+    else
+    {
+        check("pool", 0);
+    }
+
+    close_device(dev);
+    printf("%d check(s) failed\n", failures);
+    return failures != 0;
+}